@@ -9,7 +9,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/file.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdlib.h>
@@ -20,6 +19,11 @@
 #include <err.h>
 #include <signal.h>
 #include <math.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <curl/curl.h>
 #ifdef SQLLIB
 #include <sqllib.h>
@@ -30,383 +34,4206 @@
 #if	defined(SQLLIB) || defined(LIBMQTT)
 #include <axl.h>
 #endif
+#ifdef LIBSYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
 #ifdef LIBSNMP
 #include <net-snmp/net-snmp-config.h>
 #include <net-snmp/net-snmp-includes.h>
 #include <net-snmp/session_api.h>
 #endif
 
+        // Settings we set, name, help, values, then type and range (see fieldtable)
 #define	controlfields			\
-	c(pow, Power, 0/1)		\
-	c(mode, Mode, 1-7)		\
-	c(stemp, Temp, C)		\
-	c(shum, Numidity, %)		\
-	c(f_rate, Fan, A/B/3-7)		\
-	c(f_dir, Fan dir, 0-3)		\
+	c(pow, Power, 0/1, INT, 0, 1)		\
+	c(mode, Mode, 1-7, INT, 0, 7)		\
+	c(stemp, Temp, C, TEMP, 10, 33)		\
+	c(shum, Numidity, %, HUM, 0, 100)	\
+	c(f_rate, Fan, A/B/3-7, RATE, 0, 0)	\
+	c(f_dir, Fan dir, 0-3, INT, 0, 3)	\
+
+        // All other fields we know, name, type, range, flags (see fieldtable)
+#define	otherfields				\
+	f(ret, STR, 0, 0, 0)			\
+	f(adv, STR, 0, 0, CONTROL|STATE)	\
+	f(dt1, TEMP, 10, 33, CONTROL)		\
+	f(dt2, TEMP, 10, 33, CONTROL)		\
+	f(dt3, TEMP, 10, 33, CONTROL)		\
+	f(dt4, TEMP, 10, 33, CONTROL)		\
+	f(dt5, TEMP, 10, 33, CONTROL)		\
+	f(dt6, TEMP, 10, 33, CONTROL)		\
+	f(dt7, TEMP, 10, 33, CONTROL)		\
+	f(dh1, HUM, 0, 100, CONTROL)		\
+	f(dh2, HUM, 0, 100, CONTROL)		\
+	f(dh3, HUM, 0, 100, CONTROL)		\
+	f(dh4, HUM, 0, 100, CONTROL)		\
+	f(dh5, HUM, 0, 100, CONTROL)		\
+	f(dh6, HUM, 0, 100, CONTROL)		\
+	f(dh7, HUM, 0, 100, CONTROL)		\
+	f(dhh, HUM, 0, 100, CONTROL)		\
+	f(b_mode, INT, 0, 7, CONTROL)		\
+	f(b_stemp, TEMP, 10, 33, CONTROL)	\
+	f(b_shum, HUM, 0, 100, CONTROL)		\
+	f(b_f_rate, RATE, 0, 0, CONTROL)	\
+	f(b_f_dir, INT, 0, 3, CONTROL)		\
+	f(dfr1, RATE, 0, 0, CONTROL)		\
+	f(dfr2, RATE, 0, 0, CONTROL)		\
+	f(dfr3, RATE, 0, 0, CONTROL)		\
+	f(dfr4, RATE, 0, 0, CONTROL)		\
+	f(dfr5, RATE, 0, 0, CONTROL)		\
+	f(dfr6, RATE, 0, 0, CONTROL)		\
+	f(dfr7, RATE, 0, 0, CONTROL)		\
+	f(dfrh, RATE, 0, 0, CONTROL)		\
+	f(dfd1, INT, 0, 3, CONTROL)		\
+	f(dfd2, INT, 0, 3, CONTROL)		\
+	f(dfd3, INT, 0, 3, CONTROL)		\
+	f(dfd4, INT, 0, 3, CONTROL)		\
+	f(dfd5, INT, 0, 3, CONTROL)		\
+	f(dfd6, INT, 0, 3, CONTROL)		\
+	f(dfd7, INT, 0, 3, CONTROL)		\
+	f(dfdh, INT, 0, 3, CONTROL)		\
+	f(alert, STR, 0, 0, CONTROL)		\
+	f(htemp, TEMP, -50, 80, SENSOR|STATE)	\
+	f(hhum, HUM, 0, 100, SENSOR|STATE)	\
+	f(otemp, TEMP, -50, 80, SENSOR|STATE)	\
+	f(err, INT, 0, 65535, SENSOR)		\
+	f(cmpfreq, INT, 0, 200, SENSOR|STATE)	\
+	f(mompow, INT, 0, 1000, SENSOR|STATE)	\
+	f(atemp, TEMP, -50, 80, LOCAL)		\
+	f(co2, INT, 0, 10000, LOCAL)		\
+	f(rh, HUM, 0, 100, LOCAL)		\
 
 const char *modename[] = { "None", "Auto", "Dry", "Cool", "Heat", "Five", "Fan", "Auto" };
 
 int mqttdebug = 0;
 int curldebug = 0;
 int debug = 0;
+int dolock = 0;
 
-
-#ifdef LIBMQTT                  // Auto settings are done based on MQTT cmnd/[name]/atemp periodically
-double maxtemp = 30;            // Aircon temp range allowed
-double mintemp = 18;
-double ripple = 0.1;            // allow some ripple
-double startheat = -1;          // Where to start heating
-double startcool = 1;           // Where to start cooling
-double maxrheat = 1;            // Max offset to apply (reverse) - heating
-double maxfheat = 2;            // Max offset to apply (forward) - heating
-double maxrcool = 4;            // Max offset to apply (reverse) - cooling
-double maxfcool = 3;            // Max offset to apply (forward) - cooling
-double driftrate = 0.01;        // Per sample slow drift allowed
-double driftback = 0.999;       // slow return to 0
-int cmpfreqlow = 10;            // Low rate allowed
-int mqttperiod = 60;            // Logging period
-int mqttmaxdelay = 3600;        // Max delay reporting
-int resetlag = 900;             // Wait for any major change to stabilise
-int maxsamples = 60;            // For average logic
-int minsamples = 5;             // For average logic
-const char *mqttid = NULL;      // MQTT settings
-const char *mqtthost = NULL;
-const char *mqttuser = NULL;
-const char *mqttpass = NULL;
-const char *mqtttopic = "diakin";
-const char *mqttcmnd = "cmnd";
-const char *mqtttele = "tele";
-char *mqttotemp = NULL;
-char *mqttatemp = NULL;
-char *mqttco2 = NULL;
-char *mqttrh = NULL;
-
-        // This function does automatic temperature adjust
-        // If SQL available it is called at start with recent data, in order to catch up any state it needs
-        // Its job is to process current temp and settings and make any needed changes to settings
-typedef struct temp_s temp_t;
-struct temp_s
+        // Per unit locking, so we do not talk to the same aircon from two places at once
+        // Within a process each unit has a mutex. With --lock there is also a slot in a shared memory table (robust
+        // process shared mutex) so separate processes (e.g. daemon and command line) are also kept apart.
+#define	LOCKSHM		"/daikinac-locks"
+#define	LOCKSLOTS	256
+#define	LOCKMAGIC	0xDA1C0001
+typedef struct lockslot_s lockslot_t;
+struct lockslot_s
 {
-   temp_t *next;
-   time_t updated;
-   double temp;
-   double pow;
+   char ip[64];                 // Unit (empty if slot free)
+   pthread_mutex_t mutex;       // Cross process lock
+   unsigned long long waits;    // Times we had to wait
+   unsigned long long waitus;   // Total wait
+   unsigned long long maxus;    // Longest wait
 };
-typedef struct tempq_s tempq_t;
-struct tempq_s
+typedef struct locktable_s locktable_t;
+struct locktable_s
 {
-   temp_t *first,
-    *last;
-   int num;
-   double sum;
-   double sumpow;
+   volatile unsigned int magic; // Set once initialised
+   pthread_mutex_t mutex;       // Slot allocation
+   lockslot_t slot[LOCKSLOTS];
 };
-tempq_t atempq = { };
-tempq_t stempq = { };
-tempq_t stemplagq = { };
+locktable_t *locktable = NULL;
 
-double
-addtemp (tempq_t * q, time_t updated, double temp, double pow)
-{
-   if (!updated)
-      return 0;                 // Not set
-   if (q->last && q->last->updated >= updated)
-      return 0;                 // Not new
-   double last = 0;
-   if (q->last)
-      last = q->last->temp;
-   temp_t *t = malloc (sizeof (*t));
-   if (!t)
-      errx (1, "malloc");
-   t->next = NULL;
-   t->updated = updated;
-   t->temp = temp;
-   t->pow = pow;
-   q->sum += temp;
-   q->sumpow += pow;
-   q->num++;
-   if (q->last)
-      q->last->next = t;
-   else
-      q->first = t;
-   q->last = t;
-   return temp - last;
-}
+typedef struct quant_s quant_t;
+struct quant_s
+{                               // Setpoint quantiser, rounding to a step with error feedback so the average is right
+   double step;                 // Step the unit accepts (e.g. 0.5C or 1C)
+   int hold;                    // Min time between changes of output
+   double dither;               // Accumulated error
+   double lasterr;              // Error of last output
+   double last;                 // Last output
+   time_t lastset;              // Last used
+   time_t changed;              // Output last changed
+};
 
-void
-flushtemp (tempq_t * q, time_t ref, tempq_t * req)
+typedef struct unit_s unit_t;
+struct unit_s
 {
-   while (q->first && q->first->updated <= ref)
+   unit_t *next;
+   char *ip;
+   pthread_mutex_t mutex;       // In process lock
+   lockslot_t *slot;            // Cross process lock (--lock)
+   unsigned long long waits;    // Times we had to wait
+   unsigned long long waitus;   // Total wait
+   struct hist_s *hist;         // Recent history (MQTT daemon)
+   struct energy_s *energy;     // Energy counters (MQTT daemon)
+   struct control_s *control;   // Automatic control state (MQTT daemon)
+   quant_t quant;               // stemp quantiser (MQTT daemon)
+   // HTTP to the unit
+#define	UNITLATENCY	32
+   unsigned short latency[UNITLATENCY]; // Recent good request times (ms)
+   int latencies;               // Number recorded
+   int fails;                   // Consecutive failures
+   int trips;                   // Times circuit opened since last working, for backoff
+   time_t retryat;              // When open, time to try again
+   unsigned char circuit;       // CIRCUIT_x
+   char *shadow;                // Control settings last read or written (controlnorm)
+   time_t written;              // Last control write
+};
+enum
+{                               // Circuit breaker states
+   CIRCUIT_CLOSED,              // Working, requests go to unit
+   CIRCUIT_OPEN,                // Failing, requests fail at once until retryat
+   CIRCUIT_HALF,                // Trying one request to see if working again
+};
+unit_t *units = NULL;
+pthread_mutex_t unitsmutex = PTHREAD_MUTEX_INITIALIZER;
+
+unit_t *
+unitfind (const char *ip)
+{                               // Find (or create) unit
+   pthread_mutex_lock (&unitsmutex);
+   unit_t *u;
+   for (u = units; u && strcmp (u->ip, ip); u = u->next);
+   if (!u)
    {
-      temp_t *t = q->first;
-      q->num--;
-      q->sum -= t->temp;
-      q->sumpow -= t->pow;
-      q->first = t->next;
-      if (req)
-         addtemp (req, t->updated, t->temp, t->pow);
-      free (t);
-      if (!q->first)
-         q->last = NULL;
+      u = calloc (1, sizeof (*u));
+      if (!u || !(u->ip = strdup (ip)))
+         errx (1, "malloc");
+      pthread_mutex_init (&u->mutex, NULL);
+      u->next = units;
+      units = u;
    }
+   pthread_mutex_unlock (&unitsmutex);
+   return u;
 }
 
-void
-doauto (double *stempp, char *f_ratep, int *modep,      //
-        int pow, int cmpfreq, int mompow, time_t updated, double atemp, double target)
-{                               // Temp control. stemp/f_rate/mode are inputs and outputs
-   // Get values
-   double stemp = *stempp;
-   char f_rate = *f_ratep;
-   int mode = *modep;
-   // state
-   static double lastatemp = 0; // Last atemp
-   static double lasttarget = -999;     // Last values to spot changes
-   static int lastmode = 0;     //
-   static char lastf_rate = 0;  //
-   static double offset = 0;    // Offset from target to set
-   static time_t reset = 0;     // Change caused reset - this is when to start collecting data again
-   static time_t nextsample = 0;        // Make data collection reasonably regular
-   static double *t = NULL;     // Samples for averaging data
-   static int sample = 0;
-   if (!t)
-      t = malloc (sizeof (*t) * maxsamples);    // Averaging data
-
-   int s;
-   double atempdelta = atemp - lastatemp;       // Rate of change
-   lastatemp = atemp;
-
-   int overshootcheck (void)
-   {                            // react to going to overshoot
-      if ((mode == 4 && (atemp >= target + ripple || atemp + atempdelta > target + ripple) && cmpfreq > cmpfreqlow) ||
-          (mode == 3 && (atemp <= target - ripple || atemp + atempdelta < target - ripple) && cmpfreq > cmpfreqlow))
-      {                         // Time to stop compressor (setting temp 0 does this)
-         *stempp = 0;
-         reset = 0;             // We hit end stop, so can start collecting data now
-         return 1;
-      }
-      return 0;                 // OK
-
-   }
-   void resetdata (time_t lag)
-   {                            // Reset average (set to start collecting after a lag) - used when a change happens
-      reset = updated + lag;
-      for (s = 0; s < maxsamples; s++)
-         t[s] = -99;
-   }
-   void resetoffset (time_t lag)
-   {                            // Reset the offset
-      offset = (mode == 4 ? startheat : mode == 3 ? startcool : 0);
-      resetdata (lag);
+int
+lockrobust (pthread_mutex_t * m)
+{                               // Lock a robust mutex, recovering if the holder died
+   int e = pthread_mutex_lock (m);
+   if (e == EOWNERDEAD)
+   {
+      pthread_mutex_consistent (m);
+      if (debug)
+         warnx ("Recovered lock from dead process");
+      e = 0;
    }
-   if (lasttarget != target)
-   {                            // Assume offset still OK
-      if (debug > 1 && reset < updated && lasttarget)
-         warnx ("Target change to %.1lf - resetting", target);
-      lasttarget = target;
-      resetdata (resetlag);
+   return e;
+}
+
+locktable_t *
+locktableopen (void)
+{                               // Open (or create) the shared lock table
+   if (locktable)
+      return locktable;
+   int fd = shm_open (LOCKSHM, O_RDWR | O_CREAT | O_EXCL, 0666);
+   int new = (fd >= 0);
+   if (!new && errno == EEXIST)
+      fd = shm_open (LOCKSHM, O_RDWR, 0);
+   if (fd < 0)
+   {
+      warn ("Cannot open lock table %s", LOCKSHM);
+      return NULL;
    }
-   if (lastf_rate != f_rate)
-   {                            // Assume offset needs resetting
-      if (debug > 1 && reset < updated && lastf_rate)
-         warnx ("Fan change to %c - resetting", f_rate);
-      lastf_rate = f_rate;
-      resetoffset (resetlag);
+   if (new)
+   {
+      fchmod (fd, 0666);        // Not limited by umask, command line and daemon may be different users
+      if (ftruncate (fd, sizeof (locktable_t)) < 0)
+      {
+         warn ("Cannot size lock table %s", LOCKSHM);
+         close (fd);
+         shm_unlink (LOCKSHM);
+         return NULL;
+      }
    }
-   if (lastmode != mode)
-   {                            // Assume offset needs resetting
-      if (debug > 1 && reset < updated && lastmode)
-         warnx ("Mode change to %s - resetting", modename[mode]);
-      lastmode = mode;
-      resetoffset (resetlag);
+   locktable_t *t = mmap (NULL, sizeof (locktable_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close (fd);
+   if (t == MAP_FAILED)
+   {
+      warn ("Cannot map lock table %s", LOCKSHM);
+      return NULL;
    }
-   if (!pow)
-   {                            // Power off - assume offset needs resetting
-      if (debug > 1 && reset < updated)
-         warnx ("Power off - resetting");
-      resetoffset (resetlag);
+   if (new)
+   {                            // Initialise
+      pthread_mutexattr_t a;
+      pthread_mutexattr_init (&a);
+      pthread_mutexattr_setpshared (&a, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust (&a, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init (&t->mutex, &a);
+      int s;
+      for (s = 0; s < LOCKSLOTS; s++)
+         pthread_mutex_init (&t->slot[s].mutex, &a);
+      pthread_mutexattr_destroy (&a);
+      __atomic_store_n (&t->magic, LOCKMAGIC, __ATOMIC_RELEASE);
+   } else
+   {                            // Wait for creator to finish initialising
+      int tries = 100;
+      while (__atomic_load_n (&t->magic, __ATOMIC_ACQUIRE) != LOCKMAGIC && tries--)
+         usleep (10000);
+      if (t->magic != LOCKMAGIC)
+      {
+         warnx ("Lock table %s not initialised", LOCKSHM);
+         munmap (t, sizeof (locktable_t));
+         return NULL;
+      }
    }
-   if (mode == 2 || mode == 6)
+   return locktable = t;
+}
+
+lockslot_t *
+lockslot (const char *ip)
+{                               // Find (or allocate) shared lock slot for a unit
+   locktable_t *t = locktableopen ();
+   if (!t)
+      return NULL;
+   if (lockrobust (&t->mutex))
+      return NULL;
+   lockslot_t *s,
+   *spare = NULL;
+   for (s = t->slot; s < t->slot + LOCKSLOTS; s++)
+      if (!*s->ip)
+      {
+         if (!spare)
+            spare = s;
+      } else if (!strncmp (s->ip, ip, sizeof (s->ip)))
+         break;
+   if (s == t->slot + LOCKSLOTS)
    {
-      if (debug > 1 && reset < updated)
-         warnx ("Mode %s - not running automatic control", modename[mode]);
-      return;
+      s = spare;
+      if (s)
+         strncpy (s->ip, ip, sizeof (s->ip) - 1);
+      else
+         warnx ("Lock table %s full", LOCKSHM);
    }
-   // Default
-   if (mode != 3 && mode != 4)
+   pthread_mutex_unlock (&t->mutex);
+   return s;
+}
+
+void
+unitlock (unit_t * u)
+{                               // Lock a unit (in process, and cross process if --lock)
+   struct timespec start,
+     end;
+   int waited = 0;
+   if (pthread_mutex_trylock (&u->mutex))
+   {                            // Contended
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      waited = 1;
+      pthread_mutex_lock (&u->mutex);
+   }
+   if (dolock)
    {
-      if (atemp > target)
-      {
-         if (debug > 1)
-            warnx ("Taking over - changing to cool mode");
-         *modep = 3;            // Heating and we are still too high so switch to cool
-         resetoffset (resetlag);
-      } else
+      if (!u->slot)
+         u->slot = lockslot (u->ip);
+      if (u->slot)
       {
-         if (debug > 1)
-            warnx ("Taking over - changing to heat mode");
-         *modep = 4;            // Cooling and we are still too low so switch to head
-         resetoffset (resetlag);
+         int e = pthread_mutex_trylock (&u->slot->mutex);
+         if (e == EOWNERDEAD)
+            pthread_mutex_consistent (&u->slot->mutex);
+         else if (e)
+         {                      // Contended
+            if (!waited++)
+               clock_gettime (CLOCK_MONOTONIC, &start);
+            if (lockrobust (&u->slot->mutex))
+            {
+               warnx ("Cannot lock %s", u->ip);
+               u->slot = NULL;  // Carry on with in process lock only
+            }
+         }
       }
-      overshootcheck ();
+   }
+   if (!waited)
       return;
+   clock_gettime (CLOCK_MONOTONIC, &end);
+   unsigned long long us = (end.tv_sec - start.tv_sec) * 1000000ULL + end.tv_nsec / 1000 - start.tv_nsec / 1000;
+   u->waits++;
+   u->waitus += us;
+   if (u->slot)
+   {                            // We hold the slot, so safe to update
+      u->slot->waits++;
+      u->slot->waitus += us;
+      if (us > u->slot->maxus)
+         u->slot->maxus = us;
    }
+   if (debug)
+      warnx ("Waited %.3lfs for lock on %s", (double) us / 1000000, u->ip);
+   if (us >= 1000000)
+      syslog (LOG_INFO, "Waited %.3lfs for lock on %s", (double) us / 1000000, u->ip);
+}
 
-   *stempp = target + offset;   // Default
+void
+unitunlock (unit_t * u)
+{
+   if (u->slot)
+      pthread_mutex_unlock (&u->slot->mutex);
+   pthread_mutex_unlock (&u->mutex);
+}
 
-   if (updated < reset)
-   {                            // Waiting for startup or major change - reset data
-      if (debug > 1)
-         warnx ("Waiting to settle (%ds) %.1lf", (int) (reset - updated), atemp);
-      overshootcheck ();
+        // Output buffer, kept between uses so once grown there is no allocation per message or chart
+typedef struct buf_s buf_t;
+struct buf_s
+{
+   char *data;
+   size_t len;                  // Used, not including null
+   size_t size;                 // Allocated
+};
+
+void
+bufneed (buf_t * b, size_t n)
+{                               // Make space for n more bytes and a null
+   if (b->len + n < b->size)
       return;
-   }
+   size_t size = b->size ? : 1024;
+   while (size <= b->len + n)
+      size *= 2;
+   b->data = realloc (b->data, size);
+   if (!b->data)
+      errx (1, "malloc");
+   b->size = size;
+}
 
-   if (updated < nextsample)
-   {                            // Waiting for next sample at sensible time
-      overshootcheck ();
+void
+bufreset (buf_t * b)
+{
+   b->len = 0;
+   if (b->data)
+      *b->data = 0;
+}
+
+void
+bufadd (buf_t * b, const char *s)
+{
+   size_t l = strlen (s);
+   bufneed (b, l);
+   memcpy (b->data + b->len, s, l + 1);
+   b->len += l;
+}
+
+void bufprintf (buf_t * b, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void
+bufprintf (buf_t * b, const char *fmt, ...)
+{
+   va_list ap;
+   va_start (ap, fmt);
+   int l = vsnprintf (b->data ? b->data + b->len : NULL, b->size - b->len, fmt, ap);
+   va_end (ap);
+   if (l < 0)
       return;
+   if (b->len + l >= b->size)
+   {                            // Did not fit
+      bufneed (b, l);
+      va_start (ap, fmt);
+      vsnprintf (b->data + b->len, b->size - b->len, fmt, ap);
+      va_end (ap);
    }
-   if (nextsample < updated - mqttperiod)
-      nextsample = updated;
-   nextsample += mqttperiod;
+   b->len += l;
+}
 
-   t[sample++] = atemp;
-   if (sample >= maxsamples)
-      sample = 0;
-   double min = 0,
-      max = 0,
-      ave = 0;
-   int count = 0;
-   for (s = 0; s < maxsamples; s++)
+void
+bufjson (buf_t * b, const char *s)
+{                               // JSON string, quoted
+   bufneed (b, strlen (s) + 2);
+   b->data[b->len++] = '"';
+   for (; *s; s++)
    {
-      if (t[s] == -99)
-         continue;
-      if (!count || t[s] < min)
-         min = t[s];
+      if (*s < ' ')
+         bufprintf (b, "\\u%04X", *s);
+      else
+      {
+         bufneed (b, 2);
+         if (*s == '"' || *s == '\\')
+            b->data[b->len++] = '\\';
+         b->data[b->len++] = *s;
+      }
+   }
+   bufneed (b, 1);
+   b->data[b->len++] = '"';
+   b->data[b->len] = 0;
+}
+
+        // HTTP to units, with a shared DNS and connection cache, timeouts from each unit's recent request times, and
+        // a circuit breaker with exponential backoff when a unit keeps failing, so a dead unit does not hold things up
+int writegap = 2;               // Min time between control writes to a unit
+int unitfailmax = 3;            // Consecutive failures before circuit opens
+int unitbackoff = 10;           // First backoff
+int unitbackoffmax = 900;       // Max backoff
+CURLSH *curlshare = NULL;
+pthread_mutex_t curlsharemutex[CURL_LOCK_DATA_LAST];
+
+void
+curlsharelock (CURL * handle, curl_lock_data data, curl_lock_access access, void *arg)
+{
+   pthread_mutex_lock (&curlsharemutex[data]);
+}
+
+void
+curlshareunlock (CURL * handle, curl_lock_data data, void *arg)
+{
+   pthread_mutex_unlock (&curlsharemutex[data]);
+}
+
+void
+curlsetup (CURL * curl, unit_t * u)
+{                               // Set up curl handle for a request to a unit
+   if (!curlshare)
+   {
+      int n;
+      for (n = 0; n < CURL_LOCK_DATA_LAST; n++)
+         pthread_mutex_init (&curlsharemutex[n], NULL);
+      curlshare = curl_share_init ();
+      curl_share_setopt (curlshare, CURLSHOPT_LOCKFUNC, curlsharelock);
+      curl_share_setopt (curlshare, CURLSHOPT_UNLOCKFUNC, curlshareunlock);
+      curl_share_setopt (curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt (curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+   }
+   curl_easy_setopt (curl, CURLOPT_SHARE, curlshare);
+   curl_easy_setopt (curl, CURLOPT_DNS_CACHE_TIMEOUT, 3600L);
+   long timeout = 60000,
+      connect = 10000;
+   if (u && u->latencies >= UNITLATENCY / 4)
+   {                            // Enough to go on, allow a few times the 95th percentile
+      int n = (u->latencies < UNITLATENCY ? u->latencies : UNITLATENCY),
+         i;
+      unsigned short l[UNITLATENCY];
+      memcpy (l, u->latency, n * sizeof (*l));
+      int cmp (const void *a, const void *b)
+      {
+         return *(unsigned short *) a - *(unsigned short *) b;
+      }
+      qsort (l, n, sizeof (*l), cmp);
+      i = l[n * 95 / 100] * 4 + 500;
+      if (i < timeout)
+         timeout = i;
+      if (timeout < 2000)
+         timeout = 2000;
+      if (connect > timeout)
+         connect = timeout;
+   }
+   curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT_MS, connect);
+   curl_easy_setopt (curl, CURLOPT_TIMEOUT_MS, timeout);
+}
+
+int
+unitfastfail (unit_t * u)
+{                               // If we should not bother trying the unit at the moment
+   if (!u || u->circuit == CIRCUIT_CLOSED)
+      return 0;
+   if (u->circuit == CIRCUIT_HALF || time (0) < u->retryat)
+      return 1;                 // Only one try at a time when half open
+   u->circuit = CIRCUIT_HALF;
+   return 0;
+}
+
+void
+unitresult (unit_t * u, CURL * curl, int ok)
+{                               // Record how a request to the unit went
+   if (!u)
+      return;
+   if (ok)
+   {
+      double t = 0;
+      curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME, &t);
+      long ms = t * 1000;
+      u->latency[u->latencies++ % UNITLATENCY] = (ms > 65535 ? 65535 : ms);
+      if (u->latencies >= UNITLATENCY * 2)
+         u->latencies -= UNITLATENCY;   // Keep count small but still full
+      if (u->circuit != CIRCUIT_CLOSED)
+         syslog (LOG_INFO, "%s responding again", u->ip);
+      u->circuit = CIRCUIT_CLOSED;
+      u->fails = 0;
+      u->trips = 0;
+      return;
+   }
+   if (u->circuit == CIRCUIT_HALF || ++u->fails >= unitfailmax)
+   {                            // Open, backoff doubles each time, +/-25% jitter so units do not all retry at once
+      int backoff = unitbackoff;
+      int n;
+      for (n = 0; n < u->trips && backoff < unitbackoffmax; n++)
+         backoff *= 2;
+      if (backoff > unitbackoffmax)
+         backoff = unitbackoffmax;
+      backoff += (backoff / 2) * (random () % 1001) / 1000 - backoff / 4;
+      if (backoff < 1)
+         backoff = 1;
+      if (u->circuit == CIRCUIT_CLOSED)
+         syslog (LOG_INFO, "%s not responding", u->ip);
+      if (debug)
+         warnx ("%s not responding, not trying for %ds", u->ip, backoff);
+      u->circuit = CIRCUIT_OPEN;
+      u->retryat = time (0) + backoff;
+      u->trips++;
+      u->fails = 0;
+   }
+}
+
+time_t
+unitretry (unit_t * u, time_t now)
+{                               // When worth trying unit again
+   if (u && u->circuit == CIRCUIT_OPEN && u->retryat > now)
+      return u->retryat;
+   return now;
+}
+
+        // A sample of the main values for a unit at a point in time, as logged, stored and charted
+        // Scale is what we multiply by to store as an integer, 0 for a character (f_rate)
+#define	samplefields		\
+	s(atemp, 10)		\
+	s(htemp, 10)		\
+	s(otemp, 10)		\
+	s(stemp, 10)		\
+	s(dt1, 10)		\
+	s(cmpfreq, 1)		\
+	s(mompow, 1)		\
+	s(mode, 1)		\
+	s(f_rate, 0)		\
+	s(pow, 1)		\
+	s(co2, 1)		\
+	s(rh, 10)		\
+
+enum
+{
+#define s(x,m) SAMPLE_##x,
+   samplefields
+#undef s
+   SAMPLES
+};
+#define	SBIT(x)	(1U<<SAMPLE_##x)
+const char *samplename[] = {
+#define s(x,m) #x,
+   samplefields
+#undef s
+};
+const int samplescale[] = {
+#define s(x,m) m,
+   samplefields
+#undef s
+};
+
+typedef struct sample_s sample_t;
+struct sample_s
+{
+   time_t updated;
+   unsigned int present;        // SBIT() for fields we have
+   union
+   {
+      struct
+      {
+#define s(x,m) double x;
+         samplefields
+#undef s
+      };
+      double v[SAMPLES];
+   };
+};
+
+        // Fields, the settings we set (controlfields) first, so FIELD_x is also the index of a setting if below CONTROLS
+enum
+{
+#define c(x,t,v,type,min,max) FIELD_##x,
+   controlfields
+#undef c
+   CONTROLS,
+   FIELD_controls_ = CONTROLS - 1,
+#define f(x,type,min,max,flags) FIELD_##x,
+   otherfields
+#undef f
+   FIELDS
+};
+enum
+{                               // Field types
+   FT_STR,                      // Any text
+   FT_INT,                      // Integer, in range
+   FT_TEMP,                     // Temperature, in range, or - or -- for none
+   FT_HUM,                      // Humidity, in range, or AUTO or - or -- for none
+   FT_RATE,                     // Fan rate A (auto), B (silent), or 3-7
+};
+#define	FIELD_SENSOR	1       // From get_sensor_info
+#define	FIELD_CONTROL	2       // From get_control_info
+#define	FIELD_STATE	4       // Reported in MQTT STATE
+#define	FIELD_LOCAL	8       // Our own, not from the aircon
+typedef struct field_s field_t;
+struct field_s
+{
+   const char *name;
+   unsigned char type;
+   unsigned char flags;
+   signed char sample;          // SAMPLE_x, or -1
+   double min;
+   double max;
+};
+field_t fieldtable[FIELDS] = {
+#define c(x,t,v,type,min,max) {#x, FT_##type, FIELD_CONTROL | FIELD_STATE, -1, min, max},
+   controlfields
+#undef c
+#define f(x,type,min,max,flags) {#x, FT_##type, flags, -1, min, max},
+#define	SENSOR	FIELD_SENSOR
+#define	CONTROL	FIELD_CONTROL
+#define	STATE	FIELD_STATE
+#define	LOCAL	FIELD_LOCAL
+   otherfields
+#undef SENSOR
+#undef CONTROL
+#undef STATE
+#undef LOCAL
+#undef f
+};
+
+        // Perfect hash of field names, the seed is found at start up so every field has its own slot
+#define	FIELDHASH	128
+unsigned char fieldslot[FIELDHASH];     // Field + 1, 0 for none
+unsigned int fieldseed = 0;
+#define	fieldhash(h,s)	do{const char *_p=(s);h=fieldseed;while(*_p)h=(h^*_p++)*16777619U;h=(h^(h>>15))&(FIELDHASH-1);}while(0)
+
+void
+fieldinit (void)
+{                               // Find a seed for a perfect hash, and link fields to samples
+   int f;
+   for (f = 0; f < FIELDS; f++)
+   {
+      int n;
+      for (n = 0; n < SAMPLES && strcmp (samplename[n], fieldtable[f].name); n++);
+      fieldtable[f].sample = (n < SAMPLES ? n : -1);
+   }
+   for (fieldseed = 2166136261U; fieldseed < 2166136261U + 1000000; fieldseed++)
+   {
+      memset (fieldslot, 0, sizeof (fieldslot));
+      for (f = 0; f < FIELDS; f++)
+      {
+         unsigned int h;
+         fieldhash (h, fieldtable[f].name);
+         if (fieldslot[h])
+            break;
+         fieldslot[h] = f + 1;
+      }
+      if (f == FIELDS)
+         return;
+   }
+   errx (1, "No perfect hash for fields");
+}
+
+int
+fieldfind (const char *tag)
+{                               // Field for tag, or -1
+   unsigned int h;
+   fieldhash (h, tag);
+   int f = fieldslot[h] - 1;
+   if (f < 0 || strcmp (fieldtable[f].name, tag))
+      return -1;
+   return f;
+}
+
+int
+fielddecode (int f, const char *val, double *vp)
+{                               // Check value for field, return 1 if a value (character code for fan rate), 2 if valid but not a number, 0 if not valid
+   double v = 0;
+   if (!val || f < 0)
+      return 0;
+   field_t *d = &fieldtable[f];
+   switch (d->type)
+   {
+   case FT_STR:
+      return 2;
+   case FT_HUM:
+      if (!strcmp (val, "AUTO"))
+         return 2;
+      // Fall through
+   case FT_TEMP:
+      if (!strcmp (val, "-") || !strcmp (val, "--"))
+         return 2;
+      // Fall through
+   case FT_INT:
+      {
+         char *e;
+         v = strtod (val, &e);
+         if (e == val || *e || v < d->min || v > d->max || (d->type == FT_INT && v != (int) v))
+            return 0;
+      }
+      break;
+   case FT_RATE:
+      if (val[0] && !val[1] && (val[0] == 'A' || val[0] == 'B' || (val[0] >= '3' && val[0] <= '7')))
+         v = val[0];
+      else
+         return 0;
+      break;
+   }
+   if (vp)
+      *vp = v;
+   return 1;
+}
+
+        // CBOR (RFC 8949) encoding, for compact MQTT telemetry (--mqtt-format). STATE is sent as a map keyed on the field's
+        // index in fieldtable (so adding or moving fields needs CBORSCHEMA changing), with our own extras on negative keys.
+#define	CBORSCHEMA	1
+#define	CBOR_SCHEMA	-1      // Schema version
+#define	CBOR_PRIORITY	-2      // Power cap priority
+#define	CBOR_STARTED	-3      // Power cap last start
+
+void
+cborhead (buf_t * b, int major, unsigned long long v)
+{                               // Type and length or value
+   unsigned char h[9];
+   int n = 0,
+      l = (v < 24 ? 0 : v < 0x100 ? 1 : v < 0x10000 ? 2 : v < 0x100000000ULL ? 4 : 8);
+   h[n++] = (major << 5) | (l == 0 ? v : l == 1 ? 24 : l == 2 ? 25 : l == 4 ? 26 : 27);
+   while (l--)
+      h[n++] = v >> (l * 8);
+   bufneed (b, n);
+   memcpy (b->data + b->len, h, n);
+   b->len += n;
+}
+
+void
+cborint (buf_t * b, long long v)
+{
+   if (v < 0)
+      cborhead (b, 1, -1 - v);
+   else
+      cborhead (b, 0, v);
+}
+
+void
+cbortext (buf_t * b, const char *s)
+{
+   size_t l = strlen (s);
+   cborhead (b, 3, l);
+   bufneed (b, l);
+   memcpy (b->data + b->len, s, l);
+   b->len += l;
+}
+
+void
+cborfloat (buf_t * b, double v)
+{                               // Half precision if exact (e.g. 21.5), else single, which is plenty for one decimal place
+   unsigned char h[5];
+   int e,
+     n;
+   double m = frexp (fabs (v), &e);
+   if (v && m * 2048 == floor (m * 2048) && e >= -13 && e <= 16)
+   {                            // Half, normal
+      unsigned int u = (v < 0 ? 0x8000 : 0) | ((e + 14) << 10) | ((int) (m * 2048) & 0x3FF);
+      h[0] = 0xF9;
+      h[1] = u >> 8;
+      h[2] = u;
+      n = 3;
+   } else
+   {
+      float f = v;
+      unsigned int u;
+      memcpy (&u, &f, 4);
+      h[0] = 0xFA;
+      for (n = 1; n < 5; n++)
+         h[n] = u >> ((4 - n) * 8);
+   }
+   bufneed (b, n);
+   memcpy (b->data + b->len, h, n);
+   b->len += n;
+}
+
+void
+cborfield (buf_t * b, int f, const char *val)
+{                               // Field value, as number if it is one
+   double v;
+   if (fielddecode (f, val, &v) != 1 || fieldtable[f].type == FT_RATE)
+      cbortext (b, val);
+   else if (v == (long long) v)
+      cborint (b, v);
+   else
+      cborfloat (b, v);
+}
+
+void
+cborschema (buf_t * b)
+{                               // JSON description of CBOR keys
+   bufprintf (b, "{\"version\":%d,\"fields\":[", CBORSCHEMA);
+   int f;
+   for (f = 0; f < FIELDS; f++)
+   {
+      if (f)
+         bufadd (b, ",");
+      bufjson (b, fieldtable[f].name);
+   }
+   bufprintf (b, "],\"extra\":{\"%d\":\"schema\",\"%d\":\"priority\",\"%d\":\"started\"}}", CBOR_SCHEMA, CBOR_PRIORITY,
+              CBOR_STARTED);
+}
+
+int
+cborstate (buf_t * j, const unsigned char *d, int len)
+{                               // JSON STATE from CBOR STATE, as we send it, return 0 if not valid
+   const unsigned char *e = d + len;
+   char v[64];                  // Value as text
+   int value (int *textp)
+   {                            // Next item in to v, 0 if not valid or end of map
+      if (d >= e || *d == 0xFF)
+         return 0;
+      int m = *d >> 5,
+         ai = *d++ & 31,
+         n = (ai < 24 ? 0 : ai == 24 ? 1 : ai == 25 ? 2 : ai == 26 ? 4 : ai == 27 ? 8 : -1);
+      if (n < 0 || e - d < n)
+         return 0;
+      unsigned long long u = (ai < 24 ? ai : 0);
+      while (n--)
+         u = (u << 8) | *d++;
+      *textp = 0;
+      if (m == 0)
+         snprintf (v, sizeof (v), "%llu", u);
+      else if (m == 1)
+         snprintf (v, sizeof (v), "%lld", -1 - (long long) u);
+      else if (m == 3)
+      {
+         if (u >= sizeof (v) || (unsigned long long) (e - d) < u)
+            return 0;
+         memcpy (v, d, u);
+         v[u] = 0;
+         d += u;
+         *textp = 1;
+      } else if (m == 7 && ai == 25)
+      {                         // Half
+         int x = (u >> 10) & 31,
+            f = u & 0x3FF;
+         double h = (x ? ldexp (f + 1024, x - 25) : ldexp (f, -24));
+         snprintf (v, sizeof (v), "%g", (u & 0x8000) ? -h : h);
+      } else if (m == 7 && ai == 26)
+      {                         // Single
+         unsigned int b = u;
+         float f;
+         memcpy (&f, &b, 4);
+         snprintf (v, sizeof (v), "%g", f);
+      } else if (m == 7 && u == 22)
+         strcpy (v, "null");
+      else
+         return 0;
+      return 1;
+   }
+   int text;
+   if (d >= e || *d++ != 0xBF || !value (&text) || text || atoi (v) != CBOR_SCHEMA || !value (&text) || text
+       || atoi (v) != CBORSCHEMA)
+      return 0;                 // Not a map starting with our schema version
+   bufreset (j);
+   bufadd (j, "{");
+   while (value (&text))
+   {
+      if (text)
+         return 0;
+      int key = atoi (v);
+      if (!value (&text))
+         return 0;
+      if (key != CBOR_PRIORITY && key != CBOR_STARTED && (key < 0 || key >= FIELDS))
+         continue;              // Not known, skip
+      if (j->len > 1)
+         bufadd (j, ",");
+      if (key == CBOR_PRIORITY || key == CBOR_STARTED)
+         bufprintf (j, "\"%s\":%s", key == CBOR_PRIORITY ? "priority" : "started", v);
+      else
+      {                         // All strings, as JSON STATE
+         bufjson (j, fieldtable[key].name);
+         bufadd (j, ":");
+         bufjson (j, v);
+      }
+   }
+   if (d >= e || *d != 0xFF)
+      return 0;
+   bufadd (j, "}");
+   return 1;
+}
+
+        // Target temperature range by mode (see modename), 0 where the mode has no target
+const double modetempmin[] = { 10, 18, 0, 18, 10, 10, 0, 18 };
+const double modetempmax[] = { 33, 30, 0, 32, 30, 33, 0, 30 };
+
+int
+cmndfield (int f)
+{                               // Field can be set by a command, a control or dtN (which sets the target for mode N)
+   return f >= 0 && (f < CONTROLS || (f >= FIELD_dt1 && f <= FIELD_dt7));
+}
+
+#define	CMNDBAD	"&=,#?% "       // Not allowed in a command value, as it goes in a URL
+
+int
+cmndcheck (const char *tag, char **valp, int mode, const char **errorp)
+{                               // Check a command before sending, mode is current or -1 if not known
+   // Return 0 if not valid, 1 if OK, 2 if value was clamped (replaced)
+   int f = fieldfind (tag);
+   double v;
+   *errorp = NULL;
+   if (!cmndfield (f))
+   {
+      *errorp = "Unknown field";
+      return 0;
+   }
+   if (strpbrk (*valp, CMNDBAD))
+   {
+      *errorp = "Bad character in value";
+      return 0;
+   }
+   if (f >= FIELD_dt1 && f <= FIELD_dt7)
+      mode = f - FIELD_dt1 + 1; // Target temperature for that mode
+   else if (f != FIELD_stemp)
+   {                            // Rest are fixed rules
+      if (!fielddecode (f, *valp, NULL))
+      {
+         *errorp = "Invalid value";
+         return 0;
+      }
+      return 1;
+   }
+   // Temperatures, clamp to range for mode
+   double min = fieldtable[f].min,
+      max = fieldtable[f].max;
+   if (mode >= 0 && mode < sizeof (modetempmin) / sizeof (*modetempmin))
+   {
+      if (!modetempmax[mode])
+      {
+         *errorp = "No target temperature in this mode";
+         return 0;
+      }
+      min = modetempmin[mode];
+      max = modetempmax[mode];
+   }
+   char *e;
+   v = strtod (*valp, &e);
+   if (e == *valp || *e || isnan (v))
+   {
+      *errorp = "Not a temperature";
+      return 0;
+   }
+   if (v >= min && v <= max)
+      return 1;
+   v = (v < min ? min : max);
+   free (*valp);
+   if (asprintf (valp, "%.1lf", v) < 0)
+      errx (1, "malloc");
+   *errorp = "Clamped to range for mode";
+   return 2;
+}
+
+char *
+controlnorm (const char *s)
+{                               // Normalised control settings from a reply or URL query (comma or & separated), malloced
+   const char *v[CONTROLS] = { };
+   int l[CONTROLS] = { };
+   if (s && *s == '?')
+      s++;
+   while (s && *s)
+   {
+      int n = strcspn (s, "=,&");
+      if (s[n] == '=')
+      {
+         char tag[16];
+         int vl = strcspn (s + n + 1, ",&");
+         if (n < sizeof (tag))
+         {
+            memcpy (tag, s, n);
+            tag[n] = 0;
+            int f = fieldfind (tag);
+            if (f >= 0 && f < CONTROLS)
+            {
+               v[f] = s + n + 1;
+               l[f] = vl;
+            }
+         }
+         n += 1 + vl;
+      }
+      s += n;
+      if (*s)
+         s++;
+   }
+   buf_t b = { };
+   int f;
+   for (f = 0; f < CONTROLS; f++)
+   {
+      char val[32];
+      double d;
+      snprintf (val, sizeof (val), "%.*s", v[f] ? l[f] : 0, v[f] ? : "");
+      if (fieldtable[f].type != FT_RATE && fielddecode (f, val, &d) == 1)
+         bufprintf (&b, "%s%s=%g", f ? "&" : "", fieldtable[f].name, d);        // e.g. 22.0 is 22
+      else
+         bufprintf (&b, "%s%s=%s", f ? "&" : "", fieldtable[f].name, val);
+   }
+   return b.data;
+}
+
+void
+sampleset (sample_t * r, const char *tag, const char *val)
+{                               // Set a field from a tag/value as from the aircon or database
+   int f = fieldfind (tag),
+      n;
+   double v;
+   if (f < 0 || (n = fieldtable[f].sample) < 0 || fielddecode (f, val, &v) != 1)
+      return;
+   r->v[n] = v;
+   r->present |= (1U << n);
+}
+
+        // Local time series store, for sites without a database
+        // Daily segment files dir/IP/YYYY-MM-DD, a header, then records holding only what changed since the previous record.
+        // Record is varint length, varint flags, then zigzag varint time delta of delta (flag bit 0), varint present bitmap
+        // (flag bit 1), and zigzag varint value delta for each changed field (flag bit 2 onwards)
+#define	STOREMAGIC	"DKTS"
+#define	STOREVERSION	1
+#define	STOREHEADER	16      // Magic, version, fields, 2 reserved, base time (LE 64 bit)
+typedef struct store_s store_t;
+struct store_s
+{
+   store_t *next;
+   char *ip;
+   int fd;
+   char date[11];               // Segment we have open
+   time_t lastt;                // Previous record
+   time_t lastdt;
+   unsigned int present;
+   long long last[SAMPLES];
+};
+store_t *stores = NULL;
+
+int
+storeput (unsigned char *p, unsigned long long v)
+{                               // Put varint, return length
+   int n = 0;
+   while (v >= 0x80)
+   {
+      p[n++] = (v | 0x80);
+      v >>= 7;
+   }
+   p[n++] = v;
+   return n;
+}
+
+int
+storeget (const unsigned char *p, const unsigned char *e, unsigned long long *vp)
+{                               // Get varint, return length, 0 if bad
+   unsigned long long v = 0;
+   int n = 0,
+      shift = 0;
+   while (p + n < e && shift < 64)
+   {
+      v |= (unsigned long long) (p[n] & 0x7F) << shift;
+      shift += 7;
+      if (!(p[n++] & 0x80))
+      {
+         *vp = v;
+         return n;
+      }
+   }
+   return 0;
+}
+
+#define	zigzag(v)	(((unsigned long long)(v)<<1)^(unsigned long long)((long long)(v)>>63))
+#define	unzigzag(v)	((long long)((v)>>1)^-(long long)((v)&1))
+
+long long
+storeint (const sample_t * r, int n)
+{                               // Value as stored
+   return samplescale[n] ? llround (r->v[n] * samplescale[n]) : (long long) r->v[n];
+}
+
+typedef void storefound_t (sample_t *);
+size_t
+storescan (const unsigned char *data, size_t len, store_t * s, storefound_t * found)
+{                               // Decode a segment, return length of good data. State left in s if not NULL.
+   if (len < STOREHEADER || memcmp (data, STOREMAGIC, 4) || data[4] != STOREVERSION)
+      return 0;
+   int fields = data[5];
+   time_t t = 0;
+   int n;
+   for (n = 0; n < 8; n++)
+      t |= (time_t) data[8 + n] << (n * 8);
+   time_t dt = 0;
+   sample_t r = {
+   };
+   long long last[32] = {
+   };
+   const unsigned char *p = data + STOREHEADER,
+      *e = data + len;
+   while (p < e)
+   {
+      unsigned long long v,
+        flags;
+      int l = storeget (p, e, &v);
+      if (!l || v > e - p - l)
+         break;                 // Partial
+      const unsigned char *q = p + l,
+         *qe = q + v;
+      if (!(l = storeget (q, qe, &flags)))
+         break;
+      q += l;
+      if (flags & 1)
+      {                         // Time delta of delta
+         if (!(l = storeget (q, qe, &v)))
+            break;
+         q += l;
+         dt += unzigzag (v);
+      }
+      t += dt;
+      if (flags & 2)
+      {                         // Present bitmap
+         if (!(l = storeget (q, qe, &v)))
+            break;
+         q += l;
+         r.present = (v & ((1U << SAMPLES) - 1));
+      }
+      for (n = 0; n < fields && n < 32; n++)
+         if (flags & (4ULL << n))
+         {
+            if (!(l = storeget (q, qe, &v)))
+               break;
+            q += l;
+            last[n] += unzigzag (v);
+         }
+      if (n < fields && n < 32)
+         break;
+      for (n = 0; n < SAMPLES && n < fields; n++)
+         r.v[n] = (samplescale[n] ? (double) last[n] / samplescale[n] : last[n]);
+      r.updated = t;
+      p = qe;
+      if (found)
+         found (&r);
+   }
+   if (s)
+   {
+      s->lastt = t;
+      s->lastdt = dt;
+      s->present = r.present;
+      for (n = 0; n < SAMPLES; n++)
+         s->last[n] = last[n];
+   }
+   return p - data;
+}
+
+int
+storeread (const char *dir, const char *ip, const char *date, storefound_t * found)
+{                               // Read a segment, return 0 if none
+   char *fn = NULL;
+   if (asprintf (&fn, "%s/%s/%s", dir, ip, date) < 0)
+      errx (1, "malloc");
+   int fd = open (fn, O_RDONLY);
+   free (fn);
+   if (fd < 0)
+      return 0;
+   struct stat st;
+   void *data = MAP_FAILED;
+   if (!fstat (fd, &st) && st.st_size)
+      data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close (fd);
+   if (data == MAP_FAILED)
+      return 0;
+   storescan (data, st.st_size, NULL, found);
+   munmap (data, st.st_size);
+   return 1;
+}
+
+void
+storewrite (const char *dir, const char *ip, const sample_t * r)
+{                               // Append a sample
+   store_t *s;
+   for (s = stores; s && strcmp (s->ip, ip); s = s->next);
+   if (!s)
+   {
+      s = calloc (1, sizeof (*s));
+      if (!s || !(s->ip = strdup (ip)))
+         errx (1, "malloc");
+      s->fd = -1;
+      s->next = stores;
+      stores = s;
+   }
+   struct tm tm;
+   localtime_r (&r->updated, &tm);
+   char date[11];
+   strftime (date, sizeof (date), "%F", &tm);
+   if (s->fd >= 0 && strcmp (s->date, date))
+   {                            // New day
+      close (s->fd);
+      s->fd = -1;
+   }
+   if (s->fd < 0)
+   {                            // Open segment, picking up where we left off if it exists
+      char *fn = NULL;
+      if (asprintf (&fn, "%s/%s", dir, ip) < 0)
+         errx (1, "malloc");
+      mkdir (dir, 0777);
+      mkdir (fn, 0777);
+      free (fn);
+      if (asprintf (&fn, "%s/%s/%s", dir, ip, date) < 0)
+         errx (1, "malloc");
+      s->fd = open (fn, O_RDWR | O_CREAT, 0666);
+      if (s->fd < 0)
+      {
+         warn ("Cannot open %s", fn);
+         free (fn);
+         return;
+      }
+      free (fn);
+      strcpy (s->date, date);
+      struct stat st;
+      size_t good = 0;
+      if (!fstat (s->fd, &st) && st.st_size)
+      {
+         void *data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+         if (data != MAP_FAILED)
+         {
+            good = storescan (data, st.st_size, s, NULL);
+            munmap (data, st.st_size);
+         }
+      }
+      if (good < st.st_size && ftruncate (s->fd, good))
+         warn ("Cannot truncate store %s/%s", ip, date);
+      if (!good)
+      {                         // New segment
+         unsigned char h[STOREHEADER] = STOREMAGIC;
+         h[4] = STOREVERSION;
+         h[5] = SAMPLES;
+         tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+         time_t base = mktime (&tm);
+         int n;
+         for (n = 0; n < 8; n++)
+            h[8 + n] = (base >> (n * 8));
+         if (write (s->fd, h, sizeof (h)) != sizeof (h))
+            warn ("Cannot write store %s/%s", ip, date);
+         s->lastt = base;
+         s->lastdt = 0;
+         s->present = 0;
+         memset (s->last, 0, sizeof (s->last));
+      }
+      lseek (s->fd, 0, SEEK_END);
+   }
+   if (r->updated < s->lastt)
+      return;                   // Time went backwards
+   unsigned char b[16 + 10 * (SAMPLES + 3)],
+    *p = b + 10;                // Space to put length in front
+   unsigned long long flags = 0;
+   time_t dt = r->updated - s->lastt;
+   if (dt != s->lastdt)
+      flags |= 1;
+   if (r->present != s->present)
+      flags |= 2;
+   int n;
+   long long v[SAMPLES];
+   for (n = 0; n < SAMPLES; n++)
+      if ((r->present & (1U << n)) && (v[n] = storeint (r, n)) != s->last[n])
+         flags |= (4ULL << n);
+   p += storeput (p, flags);
+   if (flags & 1)
+      p += storeput (p, zigzag (dt - s->lastdt));
+   if (flags & 2)
+      p += storeput (p, r->present);
+   for (n = 0; n < SAMPLES; n++)
+      if (flags & (4ULL << n))
+         p += storeput (p, zigzag (v[n] - s->last[n]));
+   unsigned char l[10];
+   int ll = storeput (l, p - b - 10);
+   memcpy (b + 10 - ll, l, ll);
+   if (write (s->fd, b + 10 - ll, p - b - 10 + ll) < 0)
+   {
+      warn ("Cannot write store %s/%s", ip, date);
+      return;
+   }
+   s->lastt = r->updated;
+   s->lastdt = dt;
+   s->present = r->present;
+   for (n = 0; n < SAMPLES; n++)
+      if (flags & (4ULL << n))
+         s->last[n] = v[n];
+}
+
+#ifdef SQLLIB
+void
+sqlsample (SQL_RES * res, sample_t * r)
+{                               // Sample from a database row
+   memset (r, 0, sizeof (*r));
+   struct tm tm = { };
+   if (strptime (sql_colz (res, "Updated"), "%Y-%m-%d %H:%M:%S", &tm))
+   {
+      tm.tm_isdst = -1;
+      r->updated = mktime (&tm);
+   }
+   int n;
+   for (n = 0; n < SAMPLES; n++)
+      sampleset (r, samplename[n], sql_col (res, samplename[n]));
+}
+#endif
+
+
+#ifdef LIBMQTT                  // Auto settings are done based on MQTT cmnd/[name]/atemp periodically
+double maxtemp = 30;            // Aircon temp range allowed
+double mintemp = 18;
+double ripple = 0.1;            // allow some ripple
+double startheat = -1;          // Where to start heating
+double startcool = 1;           // Where to start cooling
+double maxrheat = 1;            // Max offset to apply (reverse) - heating
+double maxfheat = 2;            // Max offset to apply (forward) - heating
+double maxrcool = 4;            // Max offset to apply (reverse) - cooling
+double maxfcool = 3;            // Max offset to apply (forward) - cooling
+double driftrate = 0.01;        // Per sample slow drift allowed
+double driftback = 0.999;       // slow return to 0
+int cmpfreqlow = 10;            // Low rate allowed
+int mqttperiod = 60;            // Logging period
+int mqttmaxdelay = 3600;        // Max delay reporting
+int resetlag = 900;             // Wait for any major change to stabilise
+double stempstep = 0.5;         // Steps stemp can be set in
+int stemphold = 0;              // Min time between stemp changes
+int maxsamples = 60;            // For average logic
+int minsamples = 5;             // For average logic
+const char *mqttid = NULL;      // MQTT settings
+const char *mqtthost = NULL;
+const char *mqttuser = NULL;
+const char *mqttpass = NULL;
+const char *mqtttopic = "diakin";
+const char *mqttcmnd = "cmnd";
+const char *mqtttele = "tele";
+int mqttjson = 1;               // STATE as JSON
+int mqttcbor = 0;               // STATE as CBOR
+char *mqttotemp = NULL;
+char *mqttatemp = NULL;
+char *mqttco2 = NULL;
+char *mqttrh = NULL;
+
+double
+quantise (quant_t * q, double v, time_t now, int period)
+{                               // Quantise v, carrying the error forward (weighted by time) so the average comes out right
+   double step = (q->step > 0 ? q->step : 0.5);
+   if (!q->lastset)
+      q->lastset = now;
+   q->dither += q->lasterr * (now - q->lastset) / period;
+   double max = step * (1 + (double) q->hold / period); // Limit wind up, allowing for error built up while holding
+   if (q->dither > max)
+      q->dither = max;
+   else if (q->dither < -max)
+      q->dither = -max;
+   double out = round ((v - q->dither) / step) * step;
+   if (out < floor (v / step) * step)
+      out = floor (v / step) * step;    // Only ever a step either side
+   else if (out > ceil (v / step) * step)
+      out = ceil (v / step) * step;
+   if (q->last && out != q->last && now < q->changed + q->hold)
+      out = q->last;            // Too soon to change
+   else if (out != q->last)
+      q->changed = now;
+   q->lasterr = out - v;
+   q->lastset = now;
+   q->last = out;
+   return out;
+}
+
+        // This function does automatic temperature adjust
+        // If SQL available it is called at start with recent data, in order to catch up any state it needs
+        // Its job is to process current temp and settings and make any needed changes to settings
+typedef struct temp_s temp_t;
+struct temp_s
+{
+   temp_t *next;
+   time_t updated;
+   double temp;
+   double pow;
+};
+typedef struct tempq_s tempq_t;
+struct tempq_s
+{
+   temp_t *first,
+    *last;
+   int num;
+   double sum;
+   double sumpow;
+};
+tempq_t atempq = { };
+tempq_t stempq = { };
+tempq_t stemplagq = { };
+
+double
+addtemp (tempq_t * q, time_t updated, double temp, double pow)
+{
+   if (!updated)
+      return 0;                 // Not set
+   if (q->last && q->last->updated >= updated)
+      return 0;                 // Not new
+   double last = 0;
+   if (q->last)
+      last = q->last->temp;
+   temp_t *t = malloc (sizeof (*t));
+   if (!t)
+      errx (1, "malloc");
+   t->next = NULL;
+   t->updated = updated;
+   t->temp = temp;
+   t->pow = pow;
+   q->sum += temp;
+   q->sumpow += pow;
+   q->num++;
+   if (q->last)
+      q->last->next = t;
+   else
+      q->first = t;
+   q->last = t;
+   return temp - last;
+}
+
+void
+flushtemp (tempq_t * q, time_t ref, tempq_t * req)
+{
+   while (q->first && q->first->updated <= ref)
+   {
+      temp_t *t = q->first;
+      q->num--;
+      q->sum -= t->temp;
+      q->sumpow -= t->pow;
+      q->first = t->next;
+      if (req)
+         addtemp (req, t->updated, t->temp, t->pow);
+      free (t);
+      if (!q->first)
+         q->last = NULL;
+   }
+}
+
+void
+doauto (double *stempp, char *f_ratep, int *modep,      //
+        int pow, int cmpfreq, int mompow, time_t updated, double atemp, double target)
+{                               // Temp control. stemp/f_rate/mode are inputs and outputs
+   // Get values
+   double stemp = *stempp;
+   char f_rate = *f_ratep;
+   int mode = *modep;
+   // state
+   static double lastatemp = 0; // Last atemp
+   static double lasttarget = -999;     // Last values to spot changes
+   static int lastmode = 0;     //
+   static char lastf_rate = 0;  //
+   static double offset = 0;    // Offset from target to set
+   static time_t reset = 0;     // Change caused reset - this is when to start collecting data again
+   static time_t nextsample = 0;        // Make data collection reasonably regular
+   static double *t = NULL;     // Samples for averaging data
+   static int sample = 0;
+   if (!t)
+      t = malloc (sizeof (*t) * maxsamples);    // Averaging data
+
+   int s;
+   double atempdelta = atemp - lastatemp;       // Rate of change
+   lastatemp = atemp;
+
+   int overshootcheck (void)
+   {                            // react to going to overshoot
+      if ((mode == 4 && (atemp >= target + ripple || atemp + atempdelta > target + ripple) && cmpfreq > cmpfreqlow) ||
+          (mode == 3 && (atemp <= target - ripple || atemp + atempdelta < target - ripple) && cmpfreq > cmpfreqlow))
+      {                         // Time to stop compressor (setting temp 0 does this)
+         *stempp = 0;
+         reset = 0;             // We hit end stop, so can start collecting data now
+         return 1;
+      }
+      return 0;                 // OK
+
+   }
+   void resetdata (time_t lag)
+   {                            // Reset average (set to start collecting after a lag) - used when a change happens
+      reset = updated + lag;
+      for (s = 0; s < maxsamples; s++)
+         t[s] = -99;
+   }
+   void resetoffset (time_t lag)
+   {                            // Reset the offset
+      offset = (mode == 4 ? startheat : mode == 3 ? startcool : 0);
+      resetdata (lag);
+   }
+   if (lasttarget != target)
+   {                            // Assume offset still OK
+      if (debug > 1 && reset < updated && lasttarget)
+         warnx ("Target change to %.1lf - resetting", target);
+      lasttarget = target;
+      resetdata (resetlag);
+   }
+   if (lastf_rate != f_rate)
+   {                            // Assume offset needs resetting
+      if (debug > 1 && reset < updated && lastf_rate)
+         warnx ("Fan change to %c - resetting", f_rate);
+      lastf_rate = f_rate;
+      resetoffset (resetlag);
+   }
+   if (lastmode != mode)
+   {                            // Assume offset needs resetting
+      if (debug > 1 && reset < updated && lastmode)
+         warnx ("Mode change to %s - resetting", modename[mode]);
+      lastmode = mode;
+      resetoffset (resetlag);
+   }
+   if (!pow)
+   {                            // Power off - assume offset needs resetting
+      if (debug > 1 && reset < updated)
+         warnx ("Power off - resetting");
+      resetoffset (resetlag);
+   }
+   if (mode == 2 || mode == 6)
+   {
+      if (debug > 1 && reset < updated)
+         warnx ("Mode %s - not running automatic control", modename[mode]);
+      return;
+   }
+   // Default
+   if (mode != 3 && mode != 4)
+   {
+      if (atemp > target)
+      {
+         if (debug > 1)
+            warnx ("Taking over - changing to cool mode");
+         *modep = 3;            // Heating and we are still too high so switch to cool
+         resetoffset (resetlag);
+      } else
+      {
+         if (debug > 1)
+            warnx ("Taking over - changing to heat mode");
+         *modep = 4;            // Cooling and we are still too low so switch to head
+         resetoffset (resetlag);
+      }
+      overshootcheck ();
+      return;
+   }
+
+   *stempp = target + offset;   // Default
+
+   if (updated < reset)
+   {                            // Waiting for startup or major change - reset data
+      if (debug > 1)
+         warnx ("Waiting to settle (%ds) %.1lf", (int) (reset - updated), atemp);
+      overshootcheck ();
+      return;
+   }
+
+   if (updated < nextsample)
+   {                            // Waiting for next sample at sensible time
+      overshootcheck ();
+      return;
+   }
+   if (nextsample < updated - mqttperiod)
+      nextsample = updated;
+   nextsample += mqttperiod;
+
+   t[sample++] = atemp;
+   if (sample >= maxsamples)
+      sample = 0;
+   double min = 0,
+      max = 0,
+      ave = 0;
+   int count = 0;
+   for (s = 0; s < maxsamples; s++)
+   {
+      if (t[s] == -99)
+         continue;
+      if (!count || t[s] < min)
+         min = t[s];
       if (!count || t[s] > max)
          max = t[s];
       ave += t[s];
       count++;
    }
-   if (count < minsamples)
+   if (count < minsamples)
+   {
+      if (debug > 1)
+         warnx ("Collecting samples (%d/%d) %.1lf", count, minsamples, atemp);
+      overshootcheck ();
+      return;
+   }
+   ave /= count;                // Use mean for drift logic
+
+   if (overshootcheck ())
+      return;                   // We have set a rate to try and stop the compressor
+
+   // Adjust offset
+   if (min > target || max < target)
+   {                            // Step change
+      double step = target - (min > target ? min : max);
+      offset += step;
+      if (debug > 1)
+         warnx ("Step change by %+.1lf (min %.1lf target %.1lf max %.1lf) offset now %.1lf", step, min, target, max, offset);
+      resetdata (resetlag / 3);
+   } else if (ave < target - ripple)
+      offset += driftrate;
+   else if (ave > target + ripple)
+      offset -= driftrate;
+   else
+      offset *= driftback;
+
+   // Check if we need to change mode
+   if (mode == 4 && offset <= -maxrheat)
+   {
+      if (f_rate == 'A')
+      {
+         if (debug > 1)
+            warnx ("Changing to fan mode Night");
+         f_rate = 'B';
+         resetoffset (resetlag);
+      } else
+      {
+         if (debug > 1)
+            warnx ("Changing to cool mode");
+         mode = 3;              // Heating and we are still too high so switch to cool
+         resetoffset (resetlag);
+      }
+   } else if (mode == 3 && offset >= maxrcool)
+   {
+      if (f_rate == 'A')
+      {
+         if (debug > 1)
+            warnx ("Changing to fan mode Night");
+         f_rate = 'B';
+         resetoffset (resetlag);
+      } else
+      {
+         if (debug > 1)
+            warnx ("Changing to heat mode");
+         mode = 4;              // Cooling and we are still too low so switch to head
+         resetoffset (resetlag);
+      }
+   }
+   // Limit offset
+   if (mode == 4 && offset > maxfheat)
+   {
+      offset = maxfheat;
+      if (f_rate == 'B')
+      {
+         if (debug > 1)
+            warnx ("Changing to fan mode Auto");
+         f_rate = 'A';          // Give up on night mode
+         resetoffset (resetlag);
+      }
+   } else if (mode == 4 && offset < -maxrheat)
+      offset = -maxrheat;
+   else if (mode == 3 && offset < -maxfcool)
+   {
+      offset = -maxfcool;
+      if (f_rate == 'B')
+      {
+         if (debug > 1)
+            warnx ("Changing to fan mode Auto");
+         f_rate = 'A';          // Give up on night mode
+         resetoffset (resetlag);
+      }
+   } else if (mode == 3 && offset > maxrcool)
+      offset = maxrcool;
+   // Apply new temp
+   stemp = target + offset;     // Apply offset
+   if (debug > 1)
+      warnx ("Temp %.1lf Mode %s F_rate %c Target %.1lf Offset %+.2lf Ave %.2lf(%d) Min %.1lf Max %.1lf", atemp,
+             modename[mode], f_rate, target, offset, ave, count, min, max);
+   // Write back
+   *stempp = stemp;
+   *f_ratep = f_rate;
+   *modep = mode;
+}
+
+        // Model predictive control (--control=mpc), an alternative to doauto
+        // A simple model of the room and the aircon is fitted as we go, and each time the settings that would cost least over
+        // the next few samples are picked. The cost is mostly temperature away from target, but running and starting the
+        // compressor, and changing settings, cost too, so it does not keep stopping and starting.
+int controlmpc = 0;             // Using MPC rather than doauto, as set, copied to each unit's control_t
+int mpchorizon = 20;            // Samples to look ahead
+double mpcpower = 0.05;         // Cost of compressor at 100, per sample (error cost is C squared per sample)
+double mpcstart = 1;            // Cost of starting compressor
+double mpcchange = 0.2;         // Cost of changing stemp, per C
+double mpcmode = 5;             // Cost of changing mode or fan rate
+double mpcfan = 0.01;           // Cost of fan Auto rather than Night, per sample
+double mpcnight = 0.6;          // Fan Night limit on compressor, as fraction of max seen
+double mpcforget = 0.999;       // Fit forgetting factor per sample
+
+#define	RLSN	3               // Model parameters
+typedef struct rls_s rls_t;
+struct rls_s
+{                               // Recursive least squares fit, y=x.theta
+   double theta[RLSN];
+   double p[RLSN][RLSN];
+};
+
+void
+rlsinit (rls_t * m, const double *theta)
+{
+   memset (m, 0, sizeof (*m));
+   int i;
+   for (i = 0; i < RLSN; i++)
+   {
+      m->theta[i] = theta[i];
+      m->p[i][i] = 100;         // Not very sure of the start values
+   }
+}
+
+double
+rlsrun (const rls_t * m, const double *x)
+{
+   double y = 0;
+   int i;
+   for (i = 0; i < RLSN; i++)
+      y += x[i] * m->theta[i];
+   return y;
+}
+
+void
+rlsfit (rls_t * m, const double *x, double y)
+{                               // Update fit for a new observation, older ones fading
+   double px[RLSN],
+     d = mpcforget,
+      trace = 0;
+   int i,
+     j;
+   for (i = 0; i < RLSN; i++)
+   {
+      px[i] = 0;
+      for (j = 0; j < RLSN; j++)
+         px[i] += m->p[i][j] * x[j];
+      d += x[i] * px[i];
+      trace += m->p[i][i];
+   }
+   double e = y - rlsrun (m, x);
+   double forget = (trace > 10000 ? 1 : mpcforget);     // Stop it winding up when nothing is changing
+   for (i = 0; i < RLSN; i++)
+   {
+      m->theta[i] += px[i] * e / d;
+      for (j = 0; j < RLSN; j++)
+         m->p[i][j] = (m->p[i][j] - px[i] * px[j] / d) / forget;
+   }
+}
+
+typedef struct mpc_s mpc_t;
+struct mpc_s
+{                               // Model predictive control state
+   rls_t room;                  // atemp change per sample from otemp-atemp, heating (cmpfreq/100, -ve if cooling), 1
+   rls_t unit;                  // cmpfreq from last cmpfreq, demand (stemp-atemp, -ve if cooling), 1
+   int cmpmax;                  // Highest cmpfreq seen
+   int fits;                    // Samples fitted
+   time_t last;                 // Last sample
+   double atemp;                // Values at last sample
+   double cmpfreq;
+   double demand;
+   int sign;                    // 1 heat, -1 cool, 0 off
+};
+
+typedef struct control_s control_t;
+struct control_s
+{                               // Controller for a unit
+   int mpc;                     // Using MPC rather than doauto
+   mpc_t model;                 // MPC state
+};
+
+int
+mpcsign (int pow, int mode)
+{                               // Direction of heating for a mode
+   if (!pow)
+      return 0;
+   return mode == 4 ? 1 : mode == 3 || mode == 2 ? -1 : 0;
+}
+
+void
+mpclearn (mpc_t * m, int pow, int mode, double stemp, int cmpfreq, time_t updated, double atemp, double otemp)
+{                               // Fit the model to a new sample
+   if (!m->cmpmax)
+   {                            // Defaults, slow loss to outside, 100 heating 0.1C per minute, compressor follows demand
+      rlsinit (&m->room, (double[RLSN]) { 0.002 * mqttperiod / 60, 0.1 * mqttperiod / 60, 0 });
+      rlsinit (&m->unit, (double[RLSN]) { 0.5, 15, 10 });
+      m->cmpmax = 100;
+   }
+   if (cmpfreq > m->cmpmax)
+      m->cmpmax = cmpfreq;
+   if (m->last && updated < m->last + mqttperiod / 2)
+      return;                   // Too soon
+   int sign = mpcsign (pow, mode);
+   if (m->last && updated <= m->last + mqttperiod * 3)
+   {
+      if ((m->sign || !m->cmpfreq) && !isnan (otemp))
+      {                         // Known heating direction
+         double x[RLSN] = { otemp - m->atemp, m->sign * m->cmpfreq / 100, 1 };
+         rlsfit (&m->room, x, (atemp - m->atemp) * mqttperiod / (updated - m->last));
+      }
+      if (m->sign && sign == m->sign)
+      {                         // Same mode, running
+         double x[RLSN] = { m->cmpfreq, m->demand, 1 };
+         rlsfit (&m->unit, x, cmpfreq);
+      }
+      m->fits++;
+   }
+   m->last = updated;
+   m->atemp = atemp;
+   m->cmpfreq = cmpfreq;
+   m->demand = sign * (stemp - atemp);
+   m->sign = sign;
+}
+
+void
+mpcstep (const mpc_t * m, int mode, char f_rate, double stemp, double otemp, double *atempp, double *cmpfreqp)
+{                               // Predict a sample ahead, stemp 0 means compressor stopped
+   double atemp = *atempp,
+      cmpfreq = *cmpfreqp;
+   int sign = mpcsign (1, mode);
+   double x[RLSN] = { otemp - atemp, sign * cmpfreq / 100, 1 };
+   *atempp = atemp + rlsrun (&m->room, x);
+   if (!sign || !stemp)
+      cmpfreq = 0;
+   else
+   {
+      double y[RLSN] = { cmpfreq, sign * (stemp - atemp), 1 };
+      cmpfreq = rlsrun (&m->unit, y);
+      double max = m->cmpmax * (f_rate == 'B' ? mpcnight : 1);
+      if (cmpfreq > max)
+         cmpfreq = max;
+      if (cmpfreq < cmpfreqlow)
+         cmpfreq = 0;           // Stops
+   }
+   *cmpfreqp = cmpfreq;
+}
+
+double
+mpccost (const mpc_t * m, int mode, char f_rate, double stemp, double otemp, double atemp, double cmpfreq, double target)
+{                               // Cost of these settings over the horizon
+   double cost = 0;
+   int n;
+   for (n = 0; n < mpchorizon; n++)
+   {
+      int was = (cmpfreq > 0);
+      mpcstep (m, mode, f_rate, stemp, otemp, &atemp, &cmpfreq);
+      double e = fabs (atemp - target) - ripple;
+      if (e > 0)
+         cost += e * e;
+      cost += mpcpower * cmpfreq / 100 * cmpfreq / 100;
+      if (!was && cmpfreq > 0)
+         cost += mpcstart;
+      if (f_rate == 'A')
+         cost += mpcfan;
+   }
+   return cost;
+}
+
+void
+dompc (mpc_t * mpc, double *stempp, char *f_ratep, int *modep,  //
+       int pow, int cmpfreq, int mompow, time_t updated, double atemp, double otemp, double target)
+{                               // Temp control by MPC. stemp/f_rate/mode are inputs and outputs, stemp 0 to stop compressor
+   double stemp = *stempp;
+   char f_rate = *f_ratep;
+   int mode = *modep;
+   mpclearn (mpc, pow, mode, stemp, cmpfreq, updated, atemp, otemp);
+   if (!pow || mode == 2 || mode == 6)
+      return;
+   if (isnan (otemp))
+      otemp = atemp;            // Unknown, so assume no loss
+   double best = 0;
+   int bestmode = 0;
+   char bestf_rate = f_rate;
+   double beststemp = 0;
+   void try (int m, char f, double s)
+   {                            // Consider settings
+      double c = mpccost (mpc, m, f, s, otemp, atemp, cmpfreq, target);
+      if (!s)
+         s = (m == 4 ? mintemp : maxtemp);      // As set to stop compressor
+      c += mpcchange * fabs (s - stemp);
+      if (m != mode)
+         c += mpcmode;
+      if (f != f_rate)
+         c += mpcmode;
+      if (bestmode && c >= best)
+         return;
+      best = c;
+      bestmode = m;
+      bestf_rate = f;
+      beststemp = s;
+   }
+   char fans[3] = { f_rate };
+   if (f_rate == 'A' || f_rate == 'B')
+      strcpy (fans, "AB");      // Can pick Auto or Night, else leave fan rate as set
+   int m;
+   for (m = 3; m <= 4; m++)
+   {
+      char *f;
+      for (f = fans; *f; f++)
+      {
+         double min = target - (m == 4 ? maxrheat : maxfcool),
+            max = target + (m == 4 ? maxfheat : maxrcool),
+            s;
+         if (min < mintemp)
+            min = mintemp;
+         if (max > maxtemp)
+            max = maxtemp;
+         for (s = round (min * 2) / 2; s <= max; s += 0.5)
+            try (m, *f, s);
+         try (m, *f, 0);        // Stop compressor
+      }
+   }
+   if (debug > 1)
+      warnx ("Temp %.1lf Out %.1lf Target %.1lf Mode %s F_rate %c Stemp %.1lf cost %.2lf (room %.4lf %.4lf %+.4lf unit %.2lf %.2lf %+.2lf, %d fits)",
+             atemp, otemp, target, modename[bestmode], bestf_rate, beststemp, best, mpc->room.theta[0], mpc->room.theta[1],
+             mpc->room.theta[2], mpc->unit.theta[0], mpc->unit.theta[1], mpc->unit.theta[2], mpc->fits);
+   *stempp = (beststemp == (bestmode == 4 ? mintemp : maxtemp) ? 0 : beststemp);
+   *f_ratep = bestf_rate;
+   *modep = bestmode;
+}
+
+void
+docontrol (control_t * c, double *stempp, char *f_ratep, int *modep,    //
+           int pow, int cmpfreq, int mompow, time_t updated, double atemp, double otemp, double target)
+{                               // Automatic control, logic as selected for the unit
+   if (c->mpc)
+      dompc (&c->model, stempp, f_ratep, modep, pow, cmpfreq, mompow, updated, atemp, otemp, target);
+   else
+      doauto (stempp, f_ratep, modep, pow, cmpfreq, mompow, updated, atemp, target);
+}
+
+void
+controlbench (const sample_t * r, int n)
+{                               // Compare doauto and MPC on logged samples, each run against a model fitted to the log
+   mpc_t room = { };
+   int i;
+   for (i = 0; i < n; i++)
+      mpclearn (&room, r[i].pow, r[i].mode, r[i].stemp, r[i].cmpfreq, r[i].updated, r[i].atemp, r[i].otemp);
+   double sum2,
+     comp;
+   int count,
+     out,
+     starts,
+     changes,
+     modes;
+   void add (int dt, double atemp, double target, int was, double cmpfreq)
+   {
+      double e = atemp - target;
+      sum2 += e * e;
+      if (fabs (e) > ripple)
+         out++;
+      count++;
+      if (!was && cmpfreq > 0)
+         starts++;
+      comp += cmpfreq / 100 * dt;
+   }
+   void report (const char *name)
+   {
+      printf ("%-8s%8.2lf%8.1lf%8d%8d%8d%8.2lf\n", name, count ? sqrt (sum2 / count) : 0, count ? 100.0 * out / count : 0, starts,
+              changes, modes, comp / 3600);
+   }
+   int gap (int i)
+   {                            // Time from last sample, allowing for gaps in the log
+      int dt = r[i].updated - r[i - 1].updated;
+      return dt > mqttperiod * 3 ? mqttperiod * 3 : dt;
+   }
+   printf ("%-8s%8s%8s%8s%8s%8s%8s\n", "Control", "RMS", "Out%", "Starts", "Stemp", "Modes", "Comp-h");
+   sum2 = comp = count = out = starts = changes = modes = 0;
+   for (i = 1; i < n; i++)
+   {                            // As logged
+      if (r[i].stemp != r[i - 1].stemp)
+         changes++;
+      if (r[i].mode != r[i - 1].mode || r[i].f_rate != r[i - 1].f_rate)
+         modes++;
+      if (r[i].pow)
+         add (gap (i), r[i].atemp, r[i].dt1, r[i - 1].pow && r[i - 1].cmpfreq > 0, r[i].cmpfreq);
+   }
+   report ("logged");
+   void sim (const char *name, int usempc)
+   {                            // Run control logic against model
+      control_t control = {.mpc = usempc };    // Fresh, not the daemon's
+      quant_t quant = {.step = stempstep,.hold = stemphold };
+      sum2 = comp = count = out = starts = changes = modes = 0;
+      double atemp = r[0].atemp,
+         cmpfreq = r[0].cmpfreq,
+         stemp = r[0].stemp;
+      int mode = r[0].mode;
+      char f_rate = r[0].f_rate;
+      for (i = 1; i < n; i++)
+      {
+         double newstemp = stemp;
+         char newf_rate = f_rate;
+         int newmode = mode;
+         docontrol (&control, &newstemp, &newf_rate, &newmode, 1, cmpfreq, 0, r[i].updated, atemp, r[i].otemp, r[i].dt1);
+         if (newstemp)
+            newstemp = quantise (&quant, newstemp, r[i].updated, mqttperiod);
+         else if (newmode == 3 || newmode == 4)
+            newstemp = (newmode == 4 ? mintemp : maxtemp);      // Compressor stop
+         if (newstemp > maxtemp)
+            newstemp = maxtemp;
+         else if (newstemp < mintemp)
+            newstemp = mintemp;
+         if (newstemp != stemp)
+            changes++;
+         if (newmode != mode || newf_rate != f_rate)
+            modes++;
+         stemp = newstemp;
+         mode = newmode;
+         f_rate = newf_rate;
+         int dt = gap (i),
+            was = (cmpfreq > 0);
+         double a = atemp;
+         mpcstep (&room, mode, f_rate, stemp, r[i].otemp, &a, &cmpfreq);
+         atemp += (a - atemp) * dt / mqttperiod;
+         add (dt, atemp, r[i].dt1, was, cmpfreq);
+      }
+      report (name);
+   }
+   sim ("offset", 0);
+   sim ("mpc", 1);
+}
+
+        // Work queue for the daemon, so a user command is not stuck behind a poll, and logging waits for everything else
+        // Lower number is higher priority, FIFO within a priority
+enum
+{
+   JOB_CMND,                    // User command (cmnd/[topic]/field)
+   JOB_CONTROL,                 // Control loop write
+   JOB_POLL,                    // Telemetry poll
+   JOB_LOG,                     // Database logging
+};
+typedef struct job_s job_t;
+struct job_s
+{
+   job_t *next;
+   int pri;
+   char *tag;                   // Command field, or "replay" for journal replay
+   char *val;                   // Command value, or record to log
+   char *url;                   // Control write
+   int gen;                     // State generation the control write was worked out from
+   time_t after;                // Not before this (e.g. command waiting for write gap)
+   struct timeval queued;
+};
+job_t *jobs = NULL;
+int pollmerge = 10;             // Merge a poll due this soon in to a command that has just read status
+
+job_t *
+jobfind (int pri, const char *tag)
+{                               // Find queued job
+   job_t *j;
+   for (j = jobs; j && (j->pri != pri || (tag && (!j->tag || strcmp (j->tag, tag)))); j = j->next);
+   return j;
+}
+
+void
+jobfree (job_t * j)
+{
+   if (j->tag)
+      free (j->tag);
+   if (j->val)
+      free (j->val);
+   if (j->url)
+      free (j->url);
+   free (j);
+}
+
+job_t *
+jobadd (int pri, const char *tag, const char *val)
+{                               // Queue a job, merging with any queued job it supersedes
+   job_t *j = NULL;
+   if (tag)
+      j = jobfind (pri, tag);   // Latest value wins
+   else if (pri != JOB_LOG)
+      j = jobfind (pri, NULL);  // Only one of these needed
+   if (j)
+   {
+      if (j->val)
+         free (j->val);
+      j->val = (val ? strdup (val) : NULL);
+      if (j->url)
+         free (j->url);
+      j->url = NULL;
+      return j;
+   }
+   j = calloc (1, sizeof (*j));
+   if (!j)
+      errx (1, "malloc");
+   j->pri = pri;
+   if (tag)
+      j->tag = strdup (tag);
+   if (val)
+      j->val = strdup (val);
+   gettimeofday (&j->queued, NULL);
+   job_t **p = &jobs;
+   while (*p && (*p)->pri <= pri)
+      p = &(*p)->next;
+   j->next = *p;
+   *p = j;
+   return j;
+}
+
+job_t *
+jobnext (void)
+{                               // Take highest priority job that is due
+   time_t now = time (0);
+   job_t **p = &jobs;
+   while (*p && (*p)->after > now)
+      p = &(*p)->next;
+   job_t *j = *p;
+   if (j)
+      *p = j->next;
+   return j;
+}
+
+time_t
+jobafter (void)
+{                               // When next waiting job is due, 0 if none
+   time_t after = 0;
+   job_t *j;
+   for (j = jobs; j; j = j->next)
+      if (j->after && (!after || j->after < after))
+         after = j->after;
+   return after;
+}
+
+void
+jobdrop (int pri)
+{                               // Drop queued jobs of a priority
+   job_t **p = &jobs;
+   while (*p)
+      if ((*p)->pri == pri)
+      {
+         job_t *j = *p;
+         *p = j->next;
+         jobfree (j);
+      } else
+         p = &(*p)->next;
+}
+#endif
+
+
+        // SVG chart settings
+const int maxcmpfreq = 100;
+const int co2l = 400;           // Base CO2
+const int co2scale = 2;
+const int rhscale = 10;
+const int svgl = 2;             // Low C
+const int svgt = 32;            // High C
+const int svgc = 25;            // Per C spacing height
+const int svgh = 60;            // Per hour spacing width
+#define	svgheight	((svgt - svgl) * svgc)
+        // Chart paths, in drawing order
+#define	svgpaths	\
+	p(heat, "fill=\"red\" stroke=\"none\" opacity=\"0.5\"")	\
+	p(heatb, "fill=\"red\" stroke=\"none\" opacity=\"0.25\"")	\
+	p(cool, "fill=\"blue\" stroke=\"none\" opacity=\"0.5\"")	\
+	p(coolb, "fill=\"blue\" stroke=\"none\" opacity=\"0.25\"")	\
+	p(atemp, "fill=\"none\" stroke=\"red\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(co2, "fill=\"none\" stroke=\"orange\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(rh, "fill=\"none\" stroke=\"cyan\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(htemp, "fill=\"none\" stroke=\"green\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(otemp, "fill=\"none\" stroke=\"blue\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(mompow, "fill=\"none\" stroke=\"black\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(cmpfreq, "fill=\"none\" stroke=\"green\" opacity=\"0.5\" stroke-linecap=\"round\" stroke-linejoin=\"round\"")	\
+	p(dt1, "fill=\"none\" stroke=\"black\" stroke-dasharray=\"1\"")	\
+
+enum
+{
+#define p(n,a) SVG_##n,
+   svgpaths
+#undef p
+   SVGPATHS
+};
+
+int
+svgrender (buf_t * svg, time_t from, time_t to, int (*source) (storefound_t * found))
+{                               // Make an SVG from samples, from-to, that source passes to found, return 0 if failed
+   static __thread buf_t path[SVGPATHS];        // Kept for next chart
+   int hours = (to - from + 3599) / 3600;
+   if (hours < 1)
+      hours = 1;
+   if (hours > 24 * 31)
+      hours = 24 * 31;
+   int svgwidth = hours * svgh;
+#define p(n,a) buf_t *n = &path[SVG_##n]; bufreset (n); char n##m = 'M'; (void) n##m;
+   svgpaths
+#undef p
+   // Graph data
+   int lastmode = 0,
+      lasty = 0;
+   double x = 0,
+      stempref = -1;
+   char lastf_rate = 0;
+   void row (sample_t * r)
+   {
+      if (r->updated < from || r->updated >= to)
+         return;
+      x = (double) (r->updated - from) * svgh / 3600;
+      if (r->present & SBIT (atemp))
+      {
+         bufprintf (atemp, "%c%.2lf,%d", atempm, x, (int) (svgheight - (r->atemp - svgl) * svgc));
+         atempm = 'L';
+      }
+      if (r->present & SBIT (co2))
+      {
+         bufprintf (co2, "%c%.2lf,%d", co2m, x, (int) (svgheight - (r->co2 - co2l) / co2scale));
+         co2m = 'L';
+      }
+      if (r->present & SBIT (rh))
+      {
+         bufprintf (rh, "%c%.2lf,%d", rhm, x, (int) (svgheight - r->rh * rhscale));
+         rhm = 'L';
+      }
+      if (r->present & SBIT (htemp))
+      {
+         bufprintf (htemp, "%c%.2lf,%d", htempm, x, (int) (svgheight - (r->htemp - svgl) * svgc));
+         htempm = 'L';
+      }
+      if (r->present & SBIT (otemp))
+      {
+         bufprintf (otemp, "%c%.2lf,%d", otempm, x, (int) (svgheight - (r->otemp - svgl) * svgc));
+         otempm = 'L';
+      }
+      if (r->present & SBIT (mompow))
+      {
+         bufprintf (mompow, "%c%.2lf,%d", mompowm, x, (int) (svgheight + r->mompow));
+         mompowm = 'L';
+      }
+      if (r->present & SBIT (cmpfreq))
+      {
+         bufprintf (cmpfreq, "%c%.2lf,%d", cmpfreqm, x, (int) (svgheight + maxcmpfreq - r->cmpfreq));
+         cmpfreqm = 'L';
+      }
+      if (r->present & SBIT (dt1))
+      {
+         bufprintf (dt1, "%c%.2lf,%d", dt1m, x, (int) (svgheight - (r->dt1 - svgl) * svgc));
+         dt1m = 'L';
+      }
+      char f_rate = r->f_rate;
+      int mode = r->mode;
+      if (!r->pow)
+         mode = -1;    // Not on
+      if ((lastf_rate != f_rate || mode != lastmode) && stempref >= 0)
+      {                // Close box
+         if (lastmode == 3)
+            bufprintf (lastf_rate == 'B' ? coolb : cool, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, 0, stempref, 0);
+         if (lastmode == 4)
+            bufprintf (lastf_rate == 'B' ? heatb : heat, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, svgheight, stempref,
+                     svgheight);
+         stempref = -1;
+      }
+      if (mode == 3 || mode == 4)
+      {
+         buf_t *f = (mode == 3 ? f_rate == 'B' ? coolb : cool : f_rate == 'B' ? heatb : heat);
+         if (stempref >= 0)
+            bufprintf (f, "L%.2lf,%dL", x, lasty);
+         else
+            bufprintf (f, "M");
+         bufprintf (f, "%.2lf,%d", x, lasty = (int) (svgheight - (r->stemp - svgl) * svgc));
+         if (stempref < 0)
+            stempref = x;
+      }
+      lastmode = mode;
+      lastf_rate = f_rate;
+   }
+   int ok = source (row);
+   x += svgh / 60;     // Assume minute stats to draw last bar
+   if (lastmode == 3)
+      bufprintf (lastf_rate == 'B' ? coolb : cool, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, 0, stempref, 0);
+   if (lastmode == 4)
+      bufprintf (lastf_rate == 'B' ? heatb : heat, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, svgheight, stempref,
+               svgheight);
+   bufreset (svg);
+   bufprintf (svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\">",
+              svgwidth + 1, svgheight + maxcmpfreq + 1);  // Allow for mompow and cmpfreq
+#define p(n,a) bufprintf (svg, "<path " a " d=\"%s\"/>", n->data ? : "");
+   svgpaths
+#undef p
+   {
+      int x,
+        y;
+      // Time
+      for (x = 0; x < svgwidth + 1; x += svgh)
+      {
+         time_t t = from + x / svgh * 3600;
+         struct tm tm;
+         localtime_r (&t, &tm);
+         bufprintf (svg,
+                    "<path stroke=\"grey\" fill=\"none\" opacity=\"0.5\" stroke-dasharray=\"1\" stroke-width=\"0.5\" d=\"M%d 0v%d\"/>"
+                    "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">%02d</text>", x, svgheight + maxcmpfreq, x, svgheight,
+                    tm.tm_hour);
+      }
+      // Lines
+      for (y = svgc; y < svgheight; y += svgc)
+         bufprintf (svg,
+                    "<path stroke=\"grey\" fill=\"none\" opacity=\"0.5\" stroke-dasharray=\"1\" stroke-width=\"0.5\" d=\"M0 %dh%d\"/>",
+                    svgheight - y, svgwidth);
+      void scale (const char *colour, int x, const char *name, int (*value) (int y))
+      {                         // Scale down the side
+         for (y = svgc; y < svgheight; y += svgc)
+            bufprintf (svg,
+                       "<text opacity=\"0.5\" fill=\"%s\" text-anchor=\"end\" x=\"%d\" y=\"%d\" alignment-baseline=\"middle\">%d</text>",
+                       colour, x, svgheight - y, value (y));
+         bufprintf (svg, "<text opacity=\"0.5\" fill=\"%s\" text-anchor=\"end\" x=\"%d\" y=\"12\">%s</text>", colour, x,
+                    name);
+      }
+      int templabel (int y)
+      {
+         return y / svgc + svgl;
+      }
+      int co2label (int y)
+      {
+         return y * co2scale + co2l;
+      }
+      int rhlabel (int y)
+      {
+         return y / rhscale;
+      }
+      if (atemp->len || otemp->len || htemp->len)
+         scale ("red", 20, "℃", templabel);
+      if (co2->len)
+         scale ("orange", 60, "CO₂", co2label);
+      if (rh->len)
+         scale ("cyan", 90, "RH", rhlabel);
+   }
+   bufadd (svg, "</svg>\n");
+   return ok;
+}
+
+#ifdef SQLLIB
+int
+svgmake (FILE * out, SQL * sql, const char *table, const char *store, const char *ip, const char *date)
+{                               // Make an SVG for a date, from store if set, else database, return 0 if failed
+   static __thread buf_t svg;   // Kept for next chart
+   struct tm tm = { };
+   if (!strptime (date, "%F", &tm))
+      return 0;
+   tm.tm_isdst = -1;
+   time_t from = mktime (&tm);
+   tm.tm_mday++;
+   tm.tm_isdst = -1;
+   time_t to = mktime (&tm);    // Not always 24 hours
+   int source (storefound_t * row)
+   {
+      if (store)
+         storeread (store, ip, date, row);
+      else
+      {
+         SQL_RES *res = sql_query_store_free (sql,
+                                              sql_printf ("SELECT * FROM `%#S` WHERE `Updated` LIKE '%#S%%' AND `IP`=%#s",
+                                                          table, date, ip));
+         if (res)
+         {
+            while (sql_fetch_row (res))
+            {
+               sample_t r;
+               sqlsample (res, &r);
+               if (r.updated)
+                  row (&r);
+            }
+            sql_free_result (res);
+         } else
+            return 0;
+      }
+      return 1;
+   }
+   if (!svgrender (&svg, from, to, source))
+      return 0;
+   return fwrite (svg.data, svg.len, 1, out) == 1;
+}
+
+typedef struct svgbatch_s svgbatch_t;
+struct svgbatch_s
+{                               // Batch of SVGs for units and dates, shared by the workers
+   const char *db;
+   const char *table;
+   const char *store;
+   const char *dir;
+   const char **ips;
+   int ipn;
+   char (*dates)[11];
+   int daten;
+   int next;                    // Next to do (unit * daten + date)
+   int done;
+   int failed;
+};
+
+void *
+svgworker (void *arg)
+{                               // Make SVGs from batch until none left
+   svgbatch_t *b = arg;
+   SQL sql;
+   if (!b->store && !sql_connect (&sql, NULL, NULL, NULL, b->db, 0, NULL, 0))
+   {
+      warnx ("Cannot connect to database %s", b->db);
+      return NULL;              // Leave to other workers
+   }
+   int n;
+   while ((n = __atomic_fetch_add (&b->next, 1, __ATOMIC_RELAXED)) < b->ipn * b->daten)
+   {
+      const char *ip = b->ips[n / b->daten];
+      const char *date = b->dates[n % b->daten];
+      char *fn = NULL,
+         *tmp = NULL;
+      if (asprintf (&fn, "%s/%s-%s.svg", b->dir, ip, date) < 0 || asprintf (&tmp, "%s/.%s-%s.svg", b->dir, ip, date) < 0)
+         errx (1, "malloc");
+      FILE *o = fopen (tmp, "w");
+      int ok = (o && svgmake (o, &sql, b->table, b->store, ip, date));
+      if (o && fclose (o))
+         ok = 0;
+      if (ok && rename (tmp, fn))
+         ok = 0;
+      if (ok)
+         __atomic_add_fetch (&b->done, 1, __ATOMIC_RELAXED);
+      else
+      {
+         warn ("Failed to make %s", fn);
+         unlink (tmp);
+         __atomic_add_fetch (&b->failed, 1, __ATOMIC_RELAXED);
+      }
+      free (fn);
+      free (tmp);
+   }
+   if (!b->store)
+      sql_close (&sql);
+   return NULL;
+}
+#endif
+
+#ifdef LIBMQTT
+        // Recent history of a unit, as a ring held as struct of arrays, so one field is contiguous
+typedef struct hist_s hist_t;
+struct hist_s
+{
+   int size;                    // Slots
+   int head;                    // Next to write
+   int count;                   // Slots in use
+   unsigned int gen;            // Changes on each sample
+   time_t *updated;
+   unsigned int *present;
+   float *v[SAMPLES];           // Per field, f_rate as character code
+};
+
+        // Recent history and latest state, shared with the HTTP API thread
+pthread_mutex_t httpmutex = PTHREAD_MUTEX_INITIALIZER;
+int historyhours = 24;          // How much recent history to keep in memory
+buf_t httpstate = { };          // Latest STATE JSON
+unsigned int stategen = 0;      // Changes on each state
+time_t statetime = 0;           // When state last updated
+
+hist_t *
+historynew (int hours)
+{                               // New history, one allocation, size fixed by hours and period
+   int size = hours * 3600 / (mqttperiod ? : 60) + 1;
+   hist_t *h = calloc (1, sizeof (*h) + size * (sizeof (*h->updated) + sizeof (*h->present) + SAMPLES * sizeof (**h->v)));
+   if (!h)
+      errx (1, "malloc");
+   h->size = size;
+   h->updated = (void *) (h + 1);
+   h->present = (void *) (h->updated + size);
+   float *v = (void *) (h->present + size);
+   int n;
+   for (n = 0; n < SAMPLES; n++)
+      h->v[n] = v + n * size;
+   return h;
+}
+
+void
+historyadd (hist_t * h, const sample_t * r)
+{                               // Add sample to history
+   pthread_mutex_lock (&httpmutex);
+   if (!h->count || r->updated > h->updated[(h->head + h->size - 1) % h->size])
+   {                            // In order (warm start may overlap)
+      h->updated[h->head] = r->updated;
+      h->present[h->head] = r->present;
+      int n;
+      for (n = 0; n < SAMPLES; n++)
+         h->v[n][h->head] = r->v[n];
+      h->head = (h->head + 1) % h->size;
+      if (h->count < h->size)
+         h->count++;
+      h->gen++;
+   }
+   pthread_mutex_unlock (&httpmutex);
+}
+
+        // Slot for nth oldest entry
+#define	historyslot(h,n)	(((h)->head + (h)->size - (h)->count + (n)) % (h)->size)
+
+time_t
+historylast (hist_t * h)
+{                               // Time of latest, httpmutex must be held
+   return h->count ? h->updated[historyslot (h, h->count - 1)] : 0;
+}
+
+int
+historyfind (hist_t * h, time_t from)
+{                               // First entry (nth oldest) at or after from, httpmutex must be held
+   int lo = 0,
+      hi = h->count;
+   while (lo < hi)
+   {
+      int m = (lo + hi) / 2;
+      if (h->updated[historyslot (h, m)] < from)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   return lo;
+}
+
+int
+historyscan (hist_t * h, time_t from, storefound_t * found)
+{                               // Pass history from a time, oldest first, to found, httpmutex must be held
+   int n;
+   for (n = historyfind (h, from); n < h->count; n++)
+   {
+      int i = historyslot (h, n);
+      sample_t r = {.updated = h->updated[i],.present = h->present[i] };
+      int f;
+      for (f = 0; f < SAMPLES; f++)
+         r.v[f] = h->v[f][i];
+      found (&r);
+   }
+   return 1;
+}
+
+void
+historyjson (buf_t * b, hist_t * h, const char *ip, time_t from)
+{                               // History from a time as JSON, an array per field, httpmutex must be held
+   int start = historyfind (h, from),
+      n;
+   bufreset (b);
+   bufprintf (b, "{\"ip\":\"%s\",\"period\":%d,\"updated\":[", ip, mqttperiod);
+   for (n = start; n < h->count; n++)
+      bufprintf (b, "%s%ld", n > start ? "," : "", (long) h->updated[historyslot (h, n)]);
+   bufadd (b, "]");
+   int f;
+   for (f = 0; f < SAMPLES; f++)
+   {
+      unsigned int any = 0;
+      for (n = start; n < h->count; n++)
+         any |= h->present[historyslot (h, n)];
+      if (!(any & (1U << f)))
+         continue;              // Field not seen
+      bufprintf (b, ",\"%s\":[", samplename[f]);
+      for (n = start; n < h->count; n++)
+      {
+         int i = historyslot (h, n);
+         if (n > start)
+            bufadd (b, ",");
+         if (!(h->present[i] & (1U << f)))
+            bufadd (b, "null");
+         else if (!samplescale[f])
+            bufprintf (b, "\"%c\"", (char) h->v[f][i]);
+         else
+            bufprintf (b, "%.*f", samplescale[f] > 1 ? 1 : 0, h->v[f][i]);
+      }
+      bufadd (b, "]");
+   }
+   bufadd (b, "}");
+}
+
+void
+statecache (const buf_t * b)
+{                               // Update latest state
+   pthread_mutex_lock (&httpmutex);
+   bufreset (&httpstate);
+   bufadd (&httpstate, b->data);
+   stategen++;
+   statetime = time (0);
+   pthread_mutex_unlock (&httpmutex);
+}
+
+        // Energy accounting, integrating mompow (0.1kW) over poll intervals, and compressor duty and starts from cmpfreq
+        // Kept as running counters, and saved in the unit state file (--state) so they survive a restart
+typedef struct energyp_s energyp_t;
+struct energyp_s
+{                               // Counters for a period
+   time_t start;                // Start of period
+   double kwh;                  // Energy used
+   unsigned long long secs;     // Time counted
+   unsigned long long run;      // Time compressor running
+   unsigned long long starts;   // Compressor starts
+};
+typedef struct energy_s energy_t;
+struct energy_s
+{
+   time_t last;                 // Last sample
+   int mompow;                  // At last sample
+   int cmpfreq;
+   int mode;                    // 0 if off
+   energyp_t total;             // Since counting started
+   energyp_t hour;              // This hour
+   energyp_t day;               // Today
+   energyp_t lasthour;          // Last complete hour
+   energyp_t lastday;           // Yesterday
+   double kwhmode[sizeof (modename) / sizeof (*modename)];      // Total by mode
+};
+const char *statedir = NULL;    // Unit state directory
+
+int
+energyadd (energy_t * e, time_t now, int pow, int mode, int mompow, int cmpfreq)
+{                               // Add a sample, return 1 if an hour has completed
+   if (mode < 0 || mode >= sizeof (e->kwhmode) / sizeof (*e->kwhmode))
+      mode = 0;
+   if (!pow)
+      mode = 0;
+   struct tm tm;
+   localtime_r (&now, &tm);
+   tm.tm_min = tm.tm_sec = 0;
+   time_t hour = mktime (&tm);
+   tm.tm_hour = 0;
+   tm.tm_isdst = -1;
+   time_t day = mktime (&tm);
+   if (!e->total.start)
+      e->total.start = now;
+   int count = (e->last && now > e->last && now <= e->last + mqttperiod * 3);   // Longer is a gap, we do not know what happened
+   int dt = now - e->last;
+   double kwh (int from, int to)
+   {                            // Energy for part of the interval, trapezoid with mompow taken as linear
+      double a = e->mompow + (double) (mompow - e->mompow) * from / dt,
+         b = e->mompow + (double) (mompow - e->mompow) * to / dt;
+      return (a + b) * 0.1 / 2 * (to - from) / 3600;
+   }
+   void add (energyp_t * p, int from, int to, int end)
+   {                            // Count part of the interval, a start is counted in the part at the end
+      p->kwh += kwh (from, to);
+      p->secs += to - from;
+      if (e->cmpfreq)
+         p->run += to - from;
+      if (end && !e->cmpfreq && cmpfreq)
+         p->starts++;
+   }
+   int split (time_t start)
+   {                            // Where in the interval a new period starts
+      return start <= e->last ? 0 : start - e->last;
+   }
+   int hs = (e->hour.start != hour ? split (hour) : 0),
+      ds = (e->day.start != day ? split (day) : 0);
+   if (count)
+   {                            // Up to the end of the old hour/day
+      add (&e->total, 0, dt, 1);
+      add (&e->hour, 0, hs, 0);
+      add (&e->day, 0, ds, 0);
+      e->kwhmode[e->mode] += kwh (0, dt);
+   }
+   if (e->day.start != day)
+   {
+      if (e->day.start)
+         e->lastday = e->day;
+      memset (&e->day, 0, sizeof (e->day));
+      e->day.start = day;
+   }
+   int done = 0;
+   if (e->hour.start != hour)
+   {
+      done = (e->hour.start != 0);
+      if (done)
+         e->lasthour = e->hour;
+      memset (&e->hour, 0, sizeof (e->hour));
+      e->hour.start = hour;
+   }
+   if (count)
+   {                            // The rest in the new hour/day
+      add (&e->hour, hs, dt, 1);
+      add (&e->day, ds, dt, 1);
+   }
+   if (now > e->last)
+   {
+      e->last = now;
+      e->mompow = mompow;
+      e->cmpfreq = cmpfreq;
+      e->mode = mode;
+   }
+   return done;
+}
+
+void
+energyjson (buf_t * b, energy_t * e)
+{                               // Energy counters as JSON
+   void period (const char *tag, energyp_t * p)
+   {
+      bufprintf (b, "\"%s\":{\"start\":%ld,\"kwh\":%.3lf,\"duty\":%.1lf,\"starts\":%llu}", tag, (long) p->start, p->kwh,
+                 p->secs ? 100.0 * p->run / p->secs : 0, p->starts);
+   }
+   bufadd (b, "{");
+   period ("total", &e->total);
+   bufadd (b, ",");
+   period ("hour", &e->hour);
+   bufadd (b, ",");
+   period ("day", &e->day);
+   if (e->lasthour.start)
+   {
+      bufadd (b, ",");
+      period ("lasthour", &e->lasthour);
+   }
+   if (e->lastday.start)
+   {
+      bufadd (b, ",");
+      period ("lastday", &e->lastday);
+   }
+   bufadd (b, ",\"mode\":{");
+   int m,
+     n = 0;
+   for (m = 0; m < sizeof (e->kwhmode) / sizeof (*e->kwhmode); m++)
+      if (e->kwhmode[m])
+         bufprintf (b, "%s\"%s\":%.3lf", n++ ? "," : "", m ? modename[m] : "Off", e->kwhmode[m]);
+   bufadd (b, "}}");
+}
+
+void
+energysave (const char *dir, const char *ip, energy_t * e)
+{                               // Save counters to state file (replaced, so never half written)
+   char *fn = NULL,
+      *tmp = NULL;
+   if (asprintf (&fn, "%s/%s", dir, ip) < 0 || asprintf (&tmp, "%s.new", fn) < 0)
+      errx (1, "malloc");
+   FILE *f = fopen (tmp, "w");
+   if (!f)
+      warn ("Cannot write %s", tmp);
+   else
+   {
+      fprintf (f, "last=%ld,%d,%d,%d\n", (long) e->last, e->mompow, e->cmpfreq, e->mode);
+      void period (const char *tag, energyp_t * p)
+      {
+         fprintf (f, "%s=%ld,%.6lf,%llu,%llu,%llu\n", tag, (long) p->start, p->kwh, p->secs, p->run, p->starts);
+      }
+      period ("total", &e->total);
+      period ("hour", &e->hour);
+      period ("day", &e->day);
+      period ("lasthour", &e->lasthour);
+      period ("lastday", &e->lastday);
+      int m;
+      for (m = 0; m < sizeof (e->kwhmode) / sizeof (*e->kwhmode); m++)
+         fprintf (f, "mode%d=%.6lf\n", m, e->kwhmode[m]);
+      if (fclose (f) || rename (tmp, fn))
+         warn ("Cannot save %s", fn);
+   }
+   free (tmp);
+   free (fn);
+}
+
+void
+energyload (const char *dir, const char *ip, energy_t * e)
+{                               // Load counters from state file, if there is one
+   char *fn = NULL;
+   if (asprintf (&fn, "%s/%s", dir, ip) < 0)
+      errx (1, "malloc");
+   FILE *f = fopen (fn, "r");
+   free (fn);
+   if (!f)
+      return;
+   char line[200];
+   while (fgets (line, sizeof (line), f))
+   {
+      long t = 0;
+      int m;
+      double kwh;
+      void period (const char *tag, energyp_t * p)
+      {
+         int l = strlen (tag);
+         if (strncmp (line, tag, l) || line[l] != '=')
+            return;
+         if (sscanf (line + l + 1, "%ld,%lf,%llu,%llu,%llu", &t, &p->kwh, &p->secs, &p->run, &p->starts) == 5)
+            p->start = t;
+      }
+      if (sscanf (line, "last=%ld,%d,%d,%d", &t, &e->mompow, &e->cmpfreq, &e->mode) == 4)
+         e->last = t;
+      else if (sscanf (line, "mode%d=%lf", &m, &kwh) == 2 && m >= 0 && m < sizeof (e->kwhmode) / sizeof (*e->kwhmode))
+         e->kwhmode[m] = kwh;
+      else
+      {
+         period ("total", &e->total);
+         period ("hour", &e->hour);
+         period ("day", &e->day);
+         period ("lasthour", &e->lasthour);
+         period ("lastday", &e->lastday);
+      }
+   }
+   fclose (f);
+   if (e->mode < 0 || e->mode >= sizeof (e->kwhmode) / sizeof (*e->kwhmode))
+      e->mode = 0;
+}
+
+time_t
+httptime (const char *v, time_t def)
+{                               // Time from query, unix time or local YYYY-MM-DD[THH:MM[:SS]]
+   if (!v || !*v)
+      return def;
+   char *e;
+   long t = strtol (v, &e, 10);
+   if (!*e)
+      return t;
+   struct tm tm = { };
+   if (!(e = strptime (v, "%F", &tm)))
+      return def;
+   if ((*e == 'T' || *e == ' ') && !strptime (e + 1, "%H:%M:%S", &tm))
+      strptime (e + 1, "%H:%M", &tm);
+   tm.tm_isdst = -1;
+   return mktime (&tm);
+}
+
+void
+httpreply (int s, const char *method, int code, const char *type, const char *etag, const char *body, size_t len)
+{                               // Send HTTP reply
+   char head[300];
+   int l = snprintf (head, sizeof (head), "HTTP/1.0 %d %s\r\nConnection: close\r\nCache-Control: no-cache\r\n", code,
+                     code == 200 ? "OK" : code == 304 ? "Not modified" : code == 404 ? "Not found" : code ==
+                     405 ? "Method not allowed" : code == 503 ? "Not available" : "Bad request");
+   if (etag)
+      l += snprintf (head + l, sizeof (head) - l, "ETag: \"%s\"\r\n", etag);
+   if (code == 304)
+      len = 0;
+   l += snprintf (head + l, sizeof (head) - l, "Content-Type: %s\r\nContent-Length: %lu\r\n\r\n", type, (unsigned long) len);
+   if (write (s, head, l) != l)
+      return;
+   if (len && strcmp (method, "HEAD") && write (s, body, len) != (ssize_t) len)
+      return;
+}
+
+void
+httprequest (int s, unit_t * u)
+{                               // Handle one HTTP request
+   static buf_t chart = { };    // Last chart, kept for repeat requests
+   static char chartetag[64] = "";
+   char req[4096];
+   size_t len = 0;
+   while (len < sizeof (req) - 1)
+   {
+      ssize_t l = read (s, req + len, sizeof (req) - 1 - len);
+      if (l <= 0)
+         return;
+      len += l;
+      req[len] = 0;
+      if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n"))
+         break;
+   }
+   char *method = req,
+      *path = strchr (req, ' ');
+   if (!path)
+      return;
+   *path++ = 0;
+   char *e = strpbrk (path, " \r\n");
+   if (!e)
+      return;
+   *e++ = 0;
+   char *etag = strcasestr (e, "\nIf-None-Match:");
+   if (etag)
+   {
+      etag += 15;
+      etag += strspn (etag, " \t\"");
+      etag[strcspn (etag, "\"\r\n")] = 0;
+   }
+   char *query = strchr (path, '?');
+   if (query)
+      *query++ = 0;
+   const char *arg (const char *tag)
+   {                            // Query argument (not decoded, only times expected)
+      const char *q = query;
+      int l = strlen (tag);
+      while (q && *q)
+      {
+         if (!strncmp (q, tag, l) && q[l] == '=')
+         {
+            static char v[64];
+            q += l + 1;
+            size_t n = strcspn (q, "&");
+            if (n >= sizeof (v))
+               n = sizeof (v) - 1;
+            strncpy (v, q, n);
+            v[n] = 0;
+            for (n = 0; v[n]; n++)
+               if (v[n] == '+')
+                  v[n] = ' ';
+               else if (v[n] == '%' && isxdigit (v[n + 1]) && isxdigit (v[n + 2]))
+               {
+                  unsigned int c;
+                  sscanf (v + n + 1, "%2x", &c);
+                  v[n] = c;
+                  memmove (v + n + 1, v + n + 3, strlen (v + n + 3) + 1);
+               }
+            return v;
+         }
+         q = strchr (q, '&');
+         if (q)
+            q++;
+      }
+      return NULL;
+   }
+   if (strcmp (method, "GET") && strcmp (method, "HEAD"))
+   {
+      httpreply (s, method, 405, "text/plain", NULL, "", 0);
+      return;
+   }
+   if (!strcmp (path, "/units"))
+   {
+      char body[200];
+      int l = snprintf (body, sizeof (body), "[{\"ip\":\"%s\",\"topic\":\"%s\"}]\n", u->ip, mqtttopic);
+      httpreply (s, method, 200, "application/json", NULL, body, l);
+      return;
+   }
+   int l = strlen (u->ip);
+   if (strncmp (path, "/unit/", 6) || strncmp (path + 6, u->ip, l) || path[6 + l] != '/')
+   {
+      httpreply (s, method, 404, "text/plain", NULL, "", 0);
+      return;
+   }
+   path += 7 + l;
+   static buf_t state = { };    // Copy of STATE, so not sent while holding the lock
+   char tag[64] = "";
+   int code = 404;
+   const char *type = "text/plain";
+   buf_t *body = NULL;
+   pthread_mutex_lock (&httpmutex);    // Only long enough to get what we need, a slow client must not hold up polling
+   if (!strcmp (path, "state"))
+   {
+      if (!httpstate.len)
+         code = 503;
+      else
+      {
+         type = "application/json";
+         snprintf (tag, sizeof (tag), "s%u", stategen);
+         if (etag && !strcmp (etag, tag))
+            code = 304;
+         else
+         {
+            code = 200;
+            bufreset (&state);
+            bufneed (&state, httpstate.len);
+            memcpy (state.data, httpstate.data, httpstate.len);
+            state.len = httpstate.len;
+            body = &state;
+         }
+      }
+   } else if (!strcmp (path, "chart.svg"))
+   {
+      hist_t *h = u->hist;
+      time_t to = historylast (h) ? : time (0);
+      to = (to + 3600) / 3600 * 3600;   // Hour after latest
+      to = httptime (arg ("to"), to);
+      time_t from = httptime (arg ("from"), to - 86400);
+      if (from >= to || to - from > 86400 * 31)
+         code = 400;
+      else
+      {
+         type = "image/svg+xml";
+         snprintf (tag, sizeof (tag), "c%u-%ld-%ld", h->gen, (long) from, (long) to);
+         if (etag && !strcmp (etag, tag))
+            code = 304;
+         else
+         {
+            if (strcmp (chartetag, tag))
+            {                   // New chart
+               int source (storefound_t * found)
+               {
+                  return historyscan (h, from, found);
+               }
+               svgrender (&chart, from, to, source);
+               strcpy (chartetag, tag);
+            }
+            code = 200;
+            body = &chart;      // Only used by this thread
+         }
+      }
+   }
+   pthread_mutex_unlock (&httpmutex);
+   httpreply (s, method, code, type, *tag ? tag : NULL, body ? body->data : "", body ? body->len : 0);
+}
+
+typedef struct http_s http_t;
+struct http_s
+{
+   int s;                       // Listening socket
+   unit_t *u;
+};
+
+void *
+httpthread (void *arg)
+{                               // HTTP API, one request at a time
+   http_t *h = arg;
+   while (1)
+   {
+      int s = accept (h->s, NULL, NULL);
+      if (s < 0)
+      {
+         if (errno != EINTR)
+            usleep (100000);
+         continue;
+      }
+      struct timeval tv = {.tv_sec = 5 };
+      setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+      setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+      httprequest (s, h->u);
+      close (s);
+   }
+   return NULL;
+}
+
+void
+httpstart (const char *host, int port, unit_t * u)
+{                               // Start HTTP API
+   static http_t h;
+   struct addrinfo base = {.ai_family = AF_UNSPEC,.ai_socktype = SOCK_STREAM,.ai_flags = AI_PASSIVE }, *a;
+   char p[10];
+   snprintf (p, sizeof (p), "%d", port);
+   if (getaddrinfo (host, p, &base, &a) || !a)
+      errx (1, "Cannot find %s for HTTP", host);
+   h.s = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+   if (h.s < 0)
+      err (1, "HTTP socket");
+   int on = 1;
+   setsockopt (h.s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+   if (bind (h.s, a->ai_addr, a->ai_addrlen) || listen (h.s, 10))
+      err (1, "HTTP bind %s port %d", host, port);
+   freeaddrinfo (a);
+   h.u = u;
+   pthread_t t;
+   if (pthread_create (&t, NULL, httpthread, &h))
+      errx (1, "Cannot create HTTP thread");
+   pthread_detach (t);
+}
+
+        // Parallel HTTP, a request to each of several units at once
+typedef struct fan_s fan_t;
+struct fan_s
+{
+   const char *ip;
+   char *url;                   // Request, freed when done
+   buf_t reply;
+   int ok;                      // Got 2xx and ret=OK
+   long ms;                     // Time taken so far
+   const char *error;
+};
+
+size_t
+fanwrite (char *data, size_t size, size_t nmemb, void *arg)
+{
+   buf_t *b = arg;
+   bufneed (b, size * nmemb);
+   memcpy (b->data + b->len, data, size * nmemb);
+   b->len += size * nmemb;
+   b->data[b->len] = 0;
+   return size * nmemb;
+}
+
+void
+fanget (fan_t * f, int n)
+{                               // Do the requests (those with url set) in parallel
+   CURLM *multi = curl_multi_init ();
+   CURL *curl[n];
+   struct timeval start;
+   gettimeofday (&start, NULL);
+   int i;
+   for (i = 0; i < n; i++)
    {
-      if (debug > 1)
-         warnx ("Collecting samples (%d/%d) %.1lf", count, minsamples, atemp);
-      overshootcheck ();
+      curl[i] = NULL;
+      if (!f[i].url)
+         continue;
+      bufreset (&f[i].reply);
+      if (unitfastfail (unitfind (f[i].ip)))
+      {
+         f[i].error = "Not responding";
+         free (f[i].url);
+         f[i].url = NULL;
+         continue;
+      }
+      curl[i] = curl_easy_init ();
+      curlsetup (curl[i], unitfind (f[i].ip));
+      if (curldebug)
+         curl_easy_setopt (curl[i], CURLOPT_VERBOSE, 1L);
+      curl_easy_setopt (curl[i], CURLOPT_HTTPGET, 1L);
+      curl_easy_setopt (curl[i], CURLOPT_URL, f[i].url);
+      curl_easy_setopt (curl[i], CURLOPT_WRITEFUNCTION, fanwrite);
+      curl_easy_setopt (curl[i], CURLOPT_WRITEDATA, &f[i].reply);
+      curl_easy_setopt (curl[i], CURLOPT_PRIVATE, &f[i]);
+      curl_multi_add_handle (multi, curl[i]);
+   }
+   int running = 1;
+   while (running)
+   {
+      curl_multi_perform (multi, &running);
+      CURLMsg *m;
+      int q;
+      while ((m = curl_multi_info_read (multi, &q)))
+      {
+         if (m->msg != CURLMSG_DONE)
+            continue;
+         fan_t *r = NULL;
+         curl_easy_getinfo (m->easy_handle, CURLINFO_PRIVATE, (char **) &r);
+         struct timeval now;
+         gettimeofday (&now, NULL);
+         r->ms += (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+         long code = 0;
+         if (m->data.result)
+            r->error = curl_easy_strerror (m->data.result);
+         else if (curl_easy_getinfo (m->easy_handle, CURLINFO_RESPONSE_CODE, &code), code / 100 != 2)
+            r->error = "HTTP error";
+         else if (!r->reply.len || strncmp (r->reply.data, "ret=OK", 6))
+            r->error = "Not OK";
+         else
+         {
+            r->error = NULL;
+            r->ok = 1;
+         }
+         unitresult (unitfind (r->ip), m->easy_handle, code / 100 == 2);
+         if (r->error)
+            syslog (LOG_INFO, "Failed %s (%s)", r->url, r->error);
+         if (curldebug)
+            fprintf (stderr, "Request:\t%s\nReply:\t%s\n", r->url, r->reply.data ? : "");
+      }
+      if (running)
+         curl_multi_wait (multi, NULL, 0, 1000, NULL);
+   }
+   for (i = 0; i < n; i++)
+      if (curl[i])
+      {
+         curl_multi_remove_handle (multi, curl[i]);
+         curl_easy_cleanup (curl[i]);
+         free (f[i].url);
+         f[i].url = NULL;
+      }
+   curl_multi_cleanup (multi);
+}
+
+const char *
+replyfield (const char *reply, const char *tag, int *lenp)
+{                               // Find tag=value in a reply, return value and its length
+   int l = strlen (tag);
+   const char *p = reply;
+   while (p && *p)
+   {
+      if (!strncmp (p, tag, l) && p[l] == '=')
+      {
+         p += l + 1;
+         *lenp = strcspn (p, ",");
+         return p;
+      }
+      p = strchr (p, ',');
+      if (p)
+         p++;
+   }
+   return NULL;
+}
+
+        // Zones, named groups of units, commanded together with cmnd/zone/[name]/[field]
+typedef struct zone_s zone_t;
+struct zone_s
+{
+   zone_t *next;
+   char *name;
+   int count;
+   char **ips;                  // Sorted, so units are always locked in the same order
+};
+zone_t *zones = NULL;
+const char *mqttstat = "stat";
+
+void
+zonefree (zone_t * z)
+{                               // Free list of zones
+   while (z)
+   {
+      zone_t *n = z->next;
+      while (z->count--)
+         free (z->ips[z->count]);
+      free (z->ips);
+      free (z->name);
+      free (z);
+      z = n;
+   }
+}
+
+zone_t *
+zoneparse (char *line)
+{                               // Zone from name then IPs, space separated (line is changed), NULL if none
+   char *name = strtok (line, " \t\r\n");
+   if (!name)
+      return NULL;
+   zone_t *z = calloc (1, sizeof (*z));
+   if (!z || !(z->name = strdup (name)))
+      errx (1, "malloc");
+   char *ip;
+   while ((ip = strtok (NULL, " \t\r\n,")))
+   {
+      z->ips = realloc (z->ips, (z->count + 1) * sizeof (*z->ips));
+      if (!z->ips || !(z->ips[z->count++] = strdup (ip)))
+         errx (1, "malloc");
+   }
+   int cmp (const void *a, const void *b)
+   {
+      return strcmp (*(char **) a, *(char **) b);
+   }
+   qsort (z->ips, z->count, sizeof (*z->ips), cmp);
+   return z;
+}
+
+void
+zoneload (const char *filename)
+{                               // Load zones, each line is name then IPs, space separated
+   FILE *f = fopen (filename, "r");
+   if (!f)
+      err (1, "Cannot open %s", filename);
+   char *line = NULL;
+   size_t len = 0;
+   while (getline (&line, &len, f) > 0)
+   {
+      char *p = strchr (line, '#');
+      if (p)
+         *p = 0;
+      zone_t *z = zoneparse (line);
+      if (!z)
+         continue;
+      if (!z->count)
+         errx (1, "Zone %s has no units", z->name);
+      z->next = zones;
+      zones = z;
+   }
+   free (line);
+   fclose (f);
+}
+
+zone_t *
+zonefind (const char *name, int l)
+{
+   zone_t *z;
+   for (z = zones; z && (strncmp (z->name, name, l) || z->name[l]); z = z->next);
+   return z;
+}
+
+void
+zonecommand (buf_t * result, zone_t * z, const char *tag, const char *val, int tries)
+{                               // Set a control field on all units in a zone, in parallel, result as JSON
+   int n = z->count,
+      i;
+   fan_t f[n];
+   memset (f, 0, sizeof (f));
+   bufreset (result);
+   bufadd (result, "{\"zone\":");
+   bufjson (result, z->name);
+   bufadd (result, ",\"field\":");
+   bufjson (result, tag);
+   bufadd (result, ",\"value\":");
+   bufjson (result, val);
+   int field = fieldfind (tag);
+   if (!cmndfield (field) || strpbrk (val, CMNDBAD))
+   {
+      bufadd (result, ",\"error\":\"Bad field or value\"}");
       return;
    }
-   ave /= count;                // Use mean for drift logic
+   int dt = (field >= FIELD_dt1 && field <= FIELD_dt7 ? field - FIELD_dt1 + 1 : 0);     // Setting target for mode dt
+   char *restore[n];            // For dtN, settings to put back after
+   memset (restore, 0, sizeof (restore));
+   char *mval[n];               // Value for each unit, checked for its mode
+   memset (mval, 0, sizeof (mval));
+   const char *note[n];         // Clamped for its mode
+   memset (note, 0, sizeof (note));
+   for (i = 0; i < n; i++)
+   {                            // Lock all, in order
+      f[i].ip = z->ips[i];
+      unitlock (unitfind (f[i].ip));
+   }
+   // Read current settings
+   int t;
+   for (t = 0; t < tries; t++)
+   {
+      int more = 0;
+      for (i = 0; i < n; i++)
+         if (!f[i].ok && asprintf (&f[i].url, "http://%s/aircon/get_control_info", f[i].ip) >= 0)
+            more++;
+      if (!more)
+         break;
+      fanget (f, n);
+   }
+   // Set new settings
+   for (i = 0; i < n; i++)
+   {
+      if (!f[i].ok)
+         continue;
+      f[i].ok = 0;
+      const char *reply = f[i].reply.data;
+      int l;
+      const char *d = replyfield (reply, "mode", &l);
+      const char *error;
+      char *uval = strdup (val);
+      if (!uval)
+         errx (1, "malloc");
+      int check = cmndcheck (tag, &uval, d ? atoi (d) : -1, &error);
+      mval[i] = uval;
+      if (!check)
+      {                         // Not valid for this unit's mode, so not sent
+         f[i].error = error;
+         continue;
+      }
+      if (check == 2)
+         note[i] = error;       // Clamped
+      buf_t u = { };
+      bufprintf (&u, "http://%s/aircon/set_control_info?", f[i].ip);
+      void set (const char *x)
+      {
+         char dx[4] = { };
+         int l = 0;
+         const char *v = NULL;
+         if (!strcmp (x, tag) || (dt && !strcmp (x, "stemp")))
+            l = strlen (v = uval);
+         else if (dt && !strcmp (x, "mode"))
+         {                      // dtN is set by setting stemp in mode N, as for a single unit
+            dx[0] = '0' + dt;
+            l = strlen (v = dx);
+         } else if (!strcmp (tag, "mode") && isdigit (*val) && (!strcmp (x, "stemp") || !strcmp (x, "shum")))
+         {                      // New mode, use the temp and humidity last used for it
+            dx[0] = 'd';
+            dx[1] = x[1] == 't' ? 't' : 'h';
+            dx[2] = *val;
+            v = replyfield (reply, dx, &l);
+         }
+         if (!v)
+            v = replyfield (reply, x, &l);
+         if (v)
+            bufprintf (&u, "%s=%.*s&", x, l, v);
+      }
+      int c;
+      for (c = 0; c < CONTROLS; c++)
+         set (fieldtable[c].name);
+      u.data[--u.len] = 0;
+      char *was = controlnorm (reply),
+         *now = controlnorm (strchr (u.data, '?'));
+      d = (dt ? replyfield (reply, tag, &l) : NULL);
+      if (dt ? d && strtod (d, NULL) == strtod (uval, NULL) : !strcmp (was, now))
+      {                         // Already set, no need to write
+         f[i].ok = 1;
+         free (u.data);
+      } else
+      {
+         f[i].url = u.data;
+         if (dt && (!(d = replyfield (reply, "mode", &l)) || atoi (d) != dt))
+         {                      // Mode to put back
+            buf_t r = { };
+            bufprintf (&r, "http://%s/aircon/set_control_info?", f[i].ip);
+            for (c = 0; c < CONTROLS; c++)
+               if ((d = replyfield (reply, fieldtable[c].name, &l)))
+                  bufprintf (&r, "%s=%.*s&", fieldtable[c].name, l, d);
+            r.data[--r.len] = 0;
+            restore[i] = r.data;
+         }
+      }
+      free (was);
+      free (now);
+   }
+   fanget (f, n);
+   if (dt)
+   {                            // Put back mode where we changed it
+      for (i = 0; i < n; i++)
+         if (restore[i] && f[i].ok)
+         {                      // Written, so restore
+            f[i].url = restore[i];
+            f[i].ok = 0;
+         } else
+            free (restore[i]);
+      fanget (f, n);
+   }
+   int ok = 0;
+   bufadd (result, ",\"units\":[");
+   for (i = 0; i < n; i++)
+   {
+      unitunlock (unitfind (f[i].ip));
+      if (f[i].ok)
+         ok++;
+      bufprintf (result, "%s{\"ip\":\"%s\",\"ms\":%ld,\"ok\":%s", i ? "," : "", f[i].ip, f[i].ms, f[i].ok ? "true" : "false");
+      if (note[i])
+      {                         // Value used for this unit
+         bufadd (result, ",\"value\":");
+         bufjson (result, mval[i]);
+      }
+      if (!f[i].ok || note[i])
+      {
+         bufadd (result, ",\"error\":");
+         bufjson (result, f[i].ok ? note[i] : f[i].error ? : "No reply");
+      }
+      bufadd (result, "}");
+      free (f[i].reply.data);
+      free (mval[i]);
+   }
+   bufprintf (result, "],\"ok\":%d,\"failed\":%d}", ok, n - ok);
+}
 
-   if (overshootcheck ())
-      return;                   // We have set a rate to try and stop the compressor
+        // Estate power cap (--power-cap), for many units on one supply. Each daemon watches the others' tele/+/STATE to keep
+        // a table of peers, so between them they stay under the cap. Compressor starts are spread out, and if over the cap
+        // the lowest priority units ease off their target first (through the normal automatic control).
+int powercap = 0;               // Total W allowed, 0 for no cap
+int powerpriority = 0;          // This unit's priority, lowest eases off first
+int powerstagger = 20;          // Min time between compressor starts across units
+double powerbias = 1;           // Target change when easing off (C)
+time_t powerstarted = 0;        // Last compressor start we allowed
 
-   // Adjust offset
-   if (min > target || max < target)
-   {                            // Step change
-      double step = target - (min > target ? min : max);
-      offset += step;
-      if (debug > 1)
-         warnx ("Step change by %+.1lf (min %.1lf target %.1lf max %.1lf) offset now %.1lf", step, min, target, max, offset);
-      resetdata (resetlag / 3);
-   } else if (ave < target - ripple)
-      offset += driftrate;
-   else if (ave > target + ripple)
-      offset -= driftrate;
+#define	PEERHASH	256
+typedef struct peer_s peer_t;
+struct peer_s
+{                               // Another unit's daemon
+   peer_t *next;
+   char *topic;
+   time_t updated;              // Last STATE
+   int watts;                   // From mompow
+   int priority;
+   char *state;                 // "topic":STATE, for snapshot
+   int slot;                    // Where in snapshot
+   int slotlen;                 // Space in snapshot
+};
+peer_t *peers[PEERHASH] = { };
+
+time_t peerstart = 0;           // Last compressor start allowed by any peer
+
+unsigned int
+peerhash (const char *topic, int l)
+{
+   unsigned int h = 2166136261U;
+   while (l--)
+      h = (h ^ *topic++) * 16777619U;
+   return h;
+}
+
+peer_t *
+peerfind (const char *topic, int l)
+{                               // Find (or create) peer
+   peer_t **pp = &peers[peerhash (topic, l) % PEERHASH];
+   peer_t *p;
+   for (p = *pp; p && (strncmp (p->topic, topic, l) || p->topic[l]); p = p->next);
+   if (!p)
+   {
+      p = calloc (1, sizeof (*p));
+      if (!p || !(p->topic = strndup (topic, l)))
+         errx (1, "malloc");
+      p->next = *pp;
+      *pp = p;
+   }
+   return p;
+}
+
+const char *
+jsonfield (const char *json, const char *tag, int *lenp)
+{                               // Find "tag":value in JSON object, return value (without quotes) and its length
+   int l = strlen (tag);
+   const char *p = json;
+   while ((p = strchr (p, '"')))
+   {
+      p++;
+      if (!strncmp (p, tag, l) && p[l] == '"' && p[l + 1 + strspn (p + l + 1, " \t\r\n")] == ':')
+      {
+         p += l + 1;
+         p += strspn (p, " \t\r\n") + 1;     // Past :
+         p += strspn (p, " \t\r\n");
+         if (*p == '"')
+         {
+            p++;
+            *lenp = strcspn (p, "\"");
+         } else if (*p == '{' || *p == '[')
+         {                      // Object or array, to matching close
+            const char *e = p;
+            int depth = 0;
+            do
+            {
+               if (*e == '"')
+               {
+                  e++;
+                  while (*e && *e != '"')
+                     if (*e++ == '\\' && *e)
+                        e++;
+               } else if (*e == '{' || *e == '[')
+                  depth++;
+               else if (*e == '}' || *e == ']')
+                  depth--;
+               if (*e)
+                  e++;
+            }
+            while (*e && depth);
+            *lenp = e - p;
+         } else
+            *lenp = strcspn (p, ",}] \t\r\n");
+         return p;
+      }
+      while (*p && *p != '"')   // Skip rest of string
+         if (*p++ == '\\' && *p)
+            p++;
+      if (*p)
+         p++;
+   }
+   return NULL;
+}
+
+        // Estate snapshot (--snapshot), all units' STATE in one tele/estate/SNAPSHOT message each period, for dashboards
+        // that would otherwise subscribe to every unit. Each unit has a fixed size slot in the JSON (padded with spaces),
+        // so a new STATE is copied in place, and the whole thing is only laid out again if a unit outgrows its slot.
+int snapshot = 0;
+buf_t snapshotbuf = { };
+
+int snapshotchanged = 0;        // Since last published
+peer_t peerus = { };            // Our own STATE, not in peers as not counted for power cap
+
+void
+snapshotslot (peer_t * p)
+{                               // Copy in to slot, padded
+   int l = strlen (p->state);
+   memcpy (snapshotbuf.data + p->slot, p->state, l);
+   memset (snapshotbuf.data + p->slot + l, ' ', p->slotlen - l);
+}
+
+void
+snapshotadd (peer_t * p)
+{                               // New slot at end
+   if (!snapshotbuf.len)
+      bufadd (&snapshotbuf, "{}");
+   snapshotbuf.len--;           // Remove }
+   if (snapshotbuf.len > 1)
+      bufadd (&snapshotbuf, ",");
+   bufneed (&snapshotbuf, p->slotlen);
+   p->slot = snapshotbuf.len;
+   snapshotbuf.len += p->slotlen;
+   snapshotslot (p);
+   bufadd (&snapshotbuf, "}");
+}
+
+void
+snapshotstate (peer_t * p, const char *json, int len)
+{                               // New STATE for a unit
+   buf_t b = { };
+   bufjson (&b, p->topic);
+   if (len)
+      bufprintf (&b, ":%.*s", len, json);
    else
-      offset *= driftback;
+      bufadd (&b, ":null");     // Retained STATE cleared
+   free (p->state);
+   p->state = b.data;
+   snapshotchanged = 1;
+   if ((int) b.len <= p->slotlen)
+   {
+      snapshotslot (p);
+      return;
+   }
+   int moved = p->slotlen;
+   p->slotlen = (b.len + b.len / 2 + 63) & ~63;        // Room to grow
+   if (!moved)
+   {
+      snapshotadd (p);
+      return;
+   }
+   bufreset (&snapshotbuf);     // Lay out again
+   int n;
+   for (n = 0; n < PEERHASH; n++)
+      for (p = peers[n]; p; p = p->next)
+         if (p->state)
+            snapshotadd (p);
+   if (peerus.state)
+      snapshotadd (&peerus);
+}
 
-   // Check if we need to change mode
-   if (mode == 4 && offset <= -maxrheat)
+void
+peerstate (const char *topic, int l, const char *json, int len)
+{                               // Note a peer's STATE
+   int us = (!strncmp (topic, mqtttopic, l) && !mqtttopic[l]);
+   if (snapshot)
    {
-      if (f_rate == 'A')
+      if (us && !peerus.topic && !(peerus.topic = strdup (mqtttopic)))
+         errx (1, "malloc");
+      snapshotstate (us ? &peerus : peerfind (topic, l), json, len);
+   }
+   if (us)
+      return;
+   char *j = strndup (json, len);
+   if (!j)
+      errx (1, "malloc");
+   peer_t *p = peerfind (topic, l);
+   p->updated = time (0);
+   const char *v;
+   int n;
+   p->watts = ((v = jsonfield (j, "mompow", &n)) ? atoi (v) * 100 : 0);
+   p->priority = ((v = jsonfield (j, "priority", &n)) ? atoi (v) : 0);
+   if ((v = jsonfield (j, "started", &n)) && atol (v) > peerstart)
+      peerstart = atol (v);
+   free (j);
+}
+
+char *
+jsonselect (const char *json, int len, const char *select)
+{                               // Value at dotted path (e.g. SI7021.Temperature) in JSON, malloc'd, NULL if not found
+   char *j = strndup (json, len);
+   if (!j)
+      errx (1, "malloc");
+   while (j && *select)
+   {
+      int l = strcspn (select, ".");
+      char *tag = strndup (select, l);
+      if (!tag)
+         errx (1, "malloc");
+      int n;
+      const char *v = jsonfield (j, tag, &n);
+      char *was = j;
+      j = (v ? strndup (v, n) : NULL);
+      free (was);
+      free (tag);
+      select += l;
+      if (*select)
+         select++;
+   }
+   return j;
+}
+
+        // Sensor topic router (--mqtt-atemp, etc). Each is one or more "topic [selector] [weight]" separated by ;, topics
+        // can have + and # wildcards, and the selector is a dotted path in a JSON payload (e.g. Tasmota tele/x/SENSOR with
+        // SI7021.Temperature), else the payload is a bare number. These are held as a trie over topic levels, with all
+        // the nodes in one hash table keyed on parent and level, so a message is matched in O(topic depth).
+#define	sensorfields	\
+	s(atemp,0.5)	\
+	s(otemp,1)	\
+	s(co2,100)	\
+	s(rh,5)		\
+
+enum
+{
+#define	s(x,spread)	SENSOR_##x,
+   sensorfields
+#undef	s
+   SENSORS
+};
+const char *sensorname[] = {
+#define	s(x,spread)	#x,
+   sensorfields
+#undef	s
+};
+const double sensorspread[] = {        // Smallest deviation treated as an outlier, as sensors often agree exactly
+#define	s(x,spread)	spread,
+   sensorfields
+#undef	s
+};
+
+#define	TOPICHASH	1024
+typedef struct route_s route_t;
+struct route_s
+{                               // What to do with a message
+   route_t *next;
+   int sensor;                  // SENSOR_x
+   char *select;                // JSON selector, NULL for bare number
+   double weight;               // For sensor fusion
+};
+typedef struct topic_s topic_t;
+struct topic_s
+{                               // Trie node, one topic level
+   topic_t *next;               // Hash chain
+   topic_t *parent;
+   char *level;
+   char *pattern;               // Full topic to subscribe, if any routes
+   topic_t *subnext;            // Next with routes
+   route_t *routes;
+};
+topic_t *topics[TOPICHASH] = { };
+
+topic_t topicroot = { };
+
+topic_t *topicsubs = NULL;      // Nodes with routes
+
+topic_t *
+topicchild (topic_t * parent, const char *level, int l, int create)
+{                               // Find (or create) child node
+   topic_t **tp = &topics[(peerhash (level, l) ^ (unsigned long) parent) % TOPICHASH];
+   topic_t *t;
+   for (t = *tp; t && (t->parent != parent || strncmp (t->level, level, l) || t->level[l]); t = t->next);
+   if (!t && create)
+   {
+      t = calloc (1, sizeof (*t));
+      if (!t || !(t->level = strndup (level, l)))
+         errx (1, "malloc");
+      t->parent = parent;
+      t->next = *tp;
+      *tp = t;
+   }
+   return t;
+}
+
+const char *
+topicadd (const char *pattern, int l, int sensor, const char *select, double weight)
+{                               // Add a route, return error if not valid
+   topic_t *t = &topicroot;
+   const char *p = pattern,
+      *e = pattern + l;
+   if (!l)
+      return "No topic";
+   while (p <= e)
+   {
+      int n = 0;
+      while (p + n < e && p[n] != '/')
+         n++;
+      if ((memchr (p, '+', n) || memchr (p, '#', n)) && n != 1)
+         return "Wildcard must be a whole level";
+      if (*p == '#' && n == 1 && p + n < e)
+         return "# must be last";
+      t = topicchild (t, p, n, 1);
+      p += n + 1;
+   }
+   route_t *r = calloc (1, sizeof (*r));
+   if (!r || (select && !(r->select = strdup (select))))
+      errx (1, "malloc");
+   r->sensor = sensor;
+   r->weight = weight;
+   r->next = t->routes;
+   t->routes = r;
+   if (!t->pattern)
+   {
+      if (!(t->pattern = strndup (pattern, l)))
+         errx (1, "malloc");
+      t->subnext = topicsubs;
+      topicsubs = t;
+   }
+   return NULL;
+}
+
+void
+topicfree (void)
+{                               // Remove all routes
+   int n;
+   for (n = 0; n < TOPICHASH; n++)
+      while (topics[n])
+      {
+         topic_t *t = topics[n];
+         topics[n] = t->next;
+         while (t->routes)
+         {
+            route_t *r = t->routes;
+            t->routes = r->next;
+            free (r->select);
+            free (r);
+         }
+         free (t->level);
+         free (t->pattern);
+         free (t);
+      }
+   topicsubs = NULL;
+}
+
+void
+topicload (void)
+{                               // (Re)build routes from settings
+   topicfree ();
+   const char *sensortopic[] = {
+#define	s(x,spread)	mqtt##x,
+      sensorfields
+#undef	s
+   };
+   int n;
+   for (n = 0; n < SENSORS; n++)
+   {
+      const char *p = sensortopic[n];
+      while (p && *p)
+      {
+         p += strspn (p, " ;");
+         int l = strcspn (p, " ;");
+         const char *s = p + l;
+         char *select = NULL;
+         double weight = 1;
+         const char *error = NULL;
+         while (*(s += strspn (s, " ")) && *s != ';')
+         {                      // Selector and/or weight
+            int sl = strcspn (s, " ;");
+            char *e;
+            double w = strtod (s, &e);
+            if (e == s + sl)
+            {
+               if (w > 0)
+                  weight = w;
+               else
+                  error = "Bad weight";
+            } else
+            {
+               free (select);
+               if (!(select = strndup (s, sl)))
+                  errx (1, "malloc");
+            }
+            s += sl;
+         }
+         if (l && !error)
+            error = topicadd (p, l, n, select, weight);
+         if (error)
+            syslog (LOG_INFO, "%s sensor %s topic %.*s: %s", mqtttopic, sensorname[n], l, p, error);
+         free (select);
+         p = s;
+      }
+   }
+}
+
+void
+topicwalk (topic_t * t, const char *p, void (*found) (route_t *))
+{                               // Match rest of topic (p, NULL if no more levels) from node t
+   topic_t *c;
+   route_t *r;
+   if ((c = topicchild (t, "#", 1, 0)))
+      for (r = c->routes; r; r = r->next)
+         found (r);             // # includes parent level
+   if (!p)
+   {
+      for (r = t->routes; r; r = r->next)
+         found (r);
+      return;
+   }
+   int l = strcspn (p, "/");
+   const char *n = (p[l] ? p + l + 1 : NULL);
+   if ((c = topicchild (t, p, l, 0)))
+      topicwalk (c, n, found);
+   if ((c = topicchild (t, "+", 1, 0)))
+      topicwalk (c, n, found);
+}
+
+void
+topicmatch (const char *topic, void (*found) (route_t *))
+{                               // Call found for each route matching topic
+   if (*topic == '$')
+      return;                   // Not matched by wildcards, and not for us
+   topicwalk (&topicroot, topic, found);
+}
+
+        // Sensor fusion. Each topic (and selector) giving a sensor is a source, as are cmnd/[topic]/atemp and SNMP. The
+        // value used is the weighted mean of sources heard from in the last --mqtt-max-delay, less outliers (further from
+        // the median than --sensor-outlier times the median absolute deviation, scaled to match a standard deviation, or
+        // the sensor's spread if more). This is worked out as each reading arrives, so one bad sensor cannot whipsaw control.
+double sensoroutlier = 3;
+
+typedef struct source_s source_t;
+struct source_s
+{                               // Where a sensor reading came from
+   source_t *next;
+   int sensor;                  // SENSOR_x
+   char *name;                  // Topic (and selector), cmnd, or snmp
+   double weight;
+   double value;
+   time_t updated;
+};
+source_t *sources = NULL;
+
+int
+sensorfuse (int sensor, time_t now, double *vp)
+{                               // Fused value for sensor from fresh sources, return number used, 0 if none
+   int n = 0,
+      i,
+      used = 0;
+   source_t *s;
+   for (s = sources; s; s = s->next)
+      if (s->sensor == sensor && s->updated >= now - mqttmaxdelay)
+         n++;
+   if (!n)
+      return 0;
+   double v[n],
+     d[n];
+   int cmp (const void *a, const void *b)
+   {
+      double x = *(double *) a,
+         y = *(double *) b;
+      return x < y ? -1 : x > y;
+   }
+   n = 0;
+   for (s = sources; s; s = s->next)
+      if (s->sensor == sensor && s->updated >= now - mqttmaxdelay)
+         v[n++] = s->value;
+   qsort (v, n, sizeof (*v), cmp);
+   double median = (v[(n - 1) / 2] + v[n / 2]) / 2;
+   for (i = 0; i < n; i++)
+      d[i] = fabs (v[i] - median);
+   qsort (d, n, sizeof (*d), cmp);
+   double mad = (d[(n - 1) / 2] + d[n / 2]) / 2,
+      limit = sensoroutlier * fmax (mad * 1.4826, sensorspread[sensor]),
+      sum = 0,
+      weights = 0;
+   for (s = sources; s; s = s->next)
+      if (s->sensor == sensor && s->updated >= now - mqttmaxdelay)
+      {
+         if (fabs (s->value - median) > limit)
+         {
+            if (debug)
+               warnx ("%s=%.1lf from %s ignored, median %.1lf", sensorname[sensor], s->value, s->name, median);
+            continue;
+         }
+         sum += s->value * s->weight;
+         weights += s->weight;
+         used++;
+      }
+   *vp = sum / weights;
+   return used;
+}
+
+int
+sensorreading (int sensor, const char *name, double weight, double value, time_t now, double *vp)
+{                               // New reading from a source, return sources used and fused value
+   source_t **sp = &sources,
+      *s,
+      *this = NULL;
+   while ((s = *sp))
+   {
+      if (s->sensor == sensor && !strcmp (s->name, name))
+         this = s;
+      else if (s->updated < now - mqttmaxdelay)
+      {                         // Long gone (e.g. wildcard topic no longer sending, or setting changed)
+         *sp = s->next;
+         free (s->name);
+         free (s);
+         continue;
+      }
+      sp = &s->next;
+   }
+   if (!(s = this))
+   {
+      s = calloc (1, sizeof (*s));
+      if (!s || !(s->name = strdup (name)))
+         errx (1, "malloc");
+      s->sensor = sensor;
+      *sp = s;
+   }
+   s->weight = weight;
+   s->value = value;
+   s->updated = now;
+   return sensorfuse (sensor, now, vp);
+}
+
+void
+powerplan (time_t now, int watts, int cmpfreq, int *easep, int *holdp)
+{                               // Work out if we need to ease off, or hold off starting compressor
+   static int easing = 0;
+   int total = watts,
+      below = 0,                // Load of units that should ease off before us
+      n;
+   for (n = 0; n < PEERHASH; n++)
+   {
+      peer_t *p;
+      for (p = peers[n]; p; p = p->next)
+      {
+         if (p->updated < now - mqttperiod * 3)
+            continue;           // Gone quiet
+         total += p->watts;
+         if (p->priority < powerpriority || (p->priority == powerpriority && strcmp (p->topic, mqtttopic) < 0))
+            below += p->watts;
+      }
+   }
+   int excess = total - powercap * (easing ? 9 : 10) / 10;      // Some hysteresis
+   easing = (excess > 0 && below < excess);
+   *easep = easing;
+   *holdp = (!cmpfreq && (total >= powercap || now < peerstart + powerstagger));
+   if (debug)
+      warnx ("Power %dW of %dW cap, %dW lower priority%s%s", total, powercap, below, easing ? ", easing off" : "",
+             *holdp ? ", holding start" : "");
+}
+
+        // Config file (--config), "name value" per line. Lines after [IP] or [topic] are only for that unit's daemon, and
+        // "zone name IPs" lines define zones. It is re-read on SIGHUP. The whole file is read and checked in to a new
+        // snapshot, which the main loop swaps in between jobs, so control never sees half a change and a bad file changes
+        // nothing. Controller state is kept. Not everything can change (e.g. mqtt-period, max-samples, the unit).
+#define	configfields	\
+	d(maxtemp)	\
+	d(mintemp)	\
+	d(ripple)	\
+	d(startheat)	\
+	d(startcool)	\
+	d(maxrheat)	\
+	d(maxfheat)	\
+	d(maxrcool)	\
+	d(maxfcool)	\
+	d(driftrate)	\
+	d(driftback)	\
+	i(cmpfreqlow)	\
+	i(resetlag)	\
+	i(minsamples)	\
+	i(mqttmaxdelay)	\
+	i(pollmerge)	\
+	i(controlmpc)	\
+	i(mpchorizon)	\
+	d(mpcpower)	\
+	d(mpcstart)	\
+	d(mpcchange)	\
+	d(mpcmode)	\
+	d(mpcfan)	\
+	d(mpcnight)	\
+	d(stempstep)	\
+	i(stemphold)	\
+	i(writegap)	\
+	i(unitfailmax)	\
+	i(unitbackoff)	\
+	i(unitbackoffmax)	\
+	i(powercap)	\
+	i(powerpriority)	\
+	i(powerstagger)	\
+	d(powerbias)	\
+	d(sensoroutlier)	\
+	s(mqttatemp)	\
+	s(mqttotemp)	\
+	s(mqttco2)	\
+	s(mqttrh)	\
+
+typedef struct config_s config_t;
+struct config_s
+{                               // Config snapshot, not changed once loaded
+#define	d(x)	double x;
+#define	i(x)	int x;
+#define	s(x)	char *x;
+   configfields
+#undef	d
+#undef	i
+#undef	s
+   zone_t *zones;               // Zones, if any in file
+};
+const char *configfile = NULL;
+config_t *config = NULL;        // In use
+config_t *configbase = NULL;    // Settings before config file (defaults and command line)
+volatile sig_atomic_t configreload = 0; // SIGHUP
+
+void
+confighup (int sig)
+{
+   configreload = 1;
+}
+
+void
+configfree (config_t * c)
+{
+   if (!c)
+      return;
+#define	d(x)
+#define	i(x)
+#define	s(x)	free(c->x);
+   configfields;
+#undef	d
+#undef	i
+#undef	s
+   zonefree (c->zones);
+   free (c);
+}
+
+config_t *
+confignow (void)
+{                               // Snapshot of current settings
+   config_t *c = calloc (1, sizeof (*c));
+   if (!c)
+      errx (1, "malloc");
+#define	d(x)	c->x=x;
+#define	i(x)	c->x=x;
+#define	s(x)	if(x&&!(c->x=strdup(x)))errx(1,"malloc");
+   configfields;
+#undef	d
+#undef	i
+#undef	s
+   return c;
+}
+
+config_t *
+configread (const char *filename, const char *ip)
+{                               // Read config as a new snapshot (on top of configbase), NULL if not valid
+   FILE *f = fopen (filename, "r");
+   if (!f)
+   {
+      warn ("Cannot open %s", filename);
+      return NULL;
+   }
+   config_t *c = calloc (1, sizeof (*c));
+   if (!c)
+      errx (1, "malloc");
+#define	d(x)	c->x=configbase->x;
+#define	i(x)	c->x=configbase->x;
+#define	s(x)	if(configbase->x&&!(c->x=strdup(configbase->x)))errx(1,"malloc");
+   configfields;
+#undef	d
+#undef	i
+#undef	s
+   char *line = NULL;
+   size_t len = 0;
+   int n = 0,
+      bad = 0,
+      mine = 1;                 // Section is for us
+   zone_t **zp = &c->zones;
+   while (getline (&line, &len, f) > 0)
+   {
+      n++;
+      char *p = strchr (line, '#');
+      if (p)
+         *p = 0;
+      char *tag = line + strspn (line, " \t");
+      char *val = tag + strcspn (tag, " \t\r\n");
+      if (*val)
+         *val++ = 0;
+      val += strspn (val, " \t");
+      val[strcspn (val, "\r\n")] = 0;
+      if (!*tag)
+         continue;
+      if (*tag == '[')
+      {                         // Section for a unit
+         char *e = strchr (tag, ']');
+         if (e)
+            *e = 0;
+         mine = (!strcmp (tag + 1, ip) || !strcmp (tag + 1, mqtttopic));
+         continue;
+      }
+      if (!mine)
+         continue;
+      const char *error = NULL;
+      if (!strcmp (tag, "zone"))
       {
-         if (debug > 1)
-            warnx ("Changing to fan mode Night");
-         f_rate = 'B';
-         resetoffset (resetlag);
-      } else
+         zone_t *z = zoneparse (val);
+         if (!z || !z->count)
+         {
+            error = "Zone needs name and units";
+            zonefree (z);
+         } else
+         {
+            *zp = z;
+            zp = &z->next;
+         }
+      } else if (!strcmp (tag, "control"))
       {
-         if (debug > 1)
-            warnx ("Changing to cool mode");
-         mode = 3;              // Heating and we are still too high so switch to cool
-         resetoffset (resetlag);
+         if (!strcmp (val, "mpc"))
+            c->controlmpc = 1;
+         else if (!strcmp (val, "offset"))
+            c->controlmpc = 0;
+         else
+            error = "Unknown control";
       }
-   } else if (mode == 3 && offset >= maxrcool)
-   {
-      if (f_rate == 'A')
-      {
-         if (debug > 1)
-            warnx ("Changing to fan mode Night");
-         f_rate = 'B';
-         resetoffset (resetlag);
-      } else
+#define	d(x)	else if(!strcmp(tag,#x)){char *e;c->x=strtod(val,&e);if(e==val||*e)error="Bad number";}
+#define	i(x)	else if(!strcmp(tag,#x)){char *e;c->x=strtol(val,&e,10);if(e==val||*e)error="Bad integer";}
+#define	s(x)	else if(!strcmp(tag,#x)){free(c->x);c->x=(*val?strdup(val):NULL);}
+      configfields
+#undef	d
+#undef	i
+#undef	s
+      else
+         error = "Unknown setting";
+      if (error)
       {
-         if (debug > 1)
-            warnx ("Changing to heat mode");
-         mode = 4;              // Cooling and we are still too low so switch to head
-         resetoffset (resetlag);
+         warnx ("%s:%d %s: %s", filename, n, tag, error);
+         bad++;
       }
    }
-   // Limit offset
-   if (mode == 4 && offset > maxfheat)
+   free (line);
+   fclose (f);
+   if (!bad && (c->mintemp >= c->maxtemp || c->minsamples > maxsamples || c->minsamples < 1))
    {
-      offset = maxfheat;
-      if (f_rate == 'B')
-      {
-         if (debug > 1)
-            warnx ("Changing to fan mode Auto");
-         f_rate = 'A';          // Give up on night mode
-         resetoffset (resetlag);
-      }
-   } else if (mode == 4 && offset < -maxrheat)
-      offset = -maxrheat;
-   else if (mode == 3 && offset < -maxfcool)
+      warnx ("%s: mintemp/maxtemp or minsamples not valid", filename);
+      bad++;
+   }
+   if (bad)
    {
-      offset = -maxfcool;
-      if (f_rate == 'B')
-      {
-         if (debug > 1)
-            warnx ("Changing to fan mode Auto");
-         f_rate = 'A';          // Give up on night mode
-         resetoffset (resetlag);
-      }
-   } else if (mode == 3 && offset > maxrcool)
-      offset = maxrcool;
-   // Apply new temp
-   stemp = target + offset;     // Apply offset
-   if (debug > 1)
-      warnx ("Temp %.1lf Mode %s F_rate %c Target %.1lf Offset %+.2lf Ave %.2lf(%d) Min %.1lf Max %.1lf", atemp,
-             modename[mode], f_rate, target, offset, ave, count, min, max);
-   // Write back
-   *stempp = stemp;
-   *f_ratep = f_rate;
-   *modep = mode;
+      configfree (c);
+      return NULL;
+   }
+   return c;
 }
-#endif
 
+int
+configapply (config_t * c, unit_t * u)
+{                               // Swap in new config, return 1 if MQTT subscriptions need doing again
+   int resub = 0;
+#define	str(a,b)	((a)==(b)||((a)&&(b)&&!strcmp(a,b)))
+#define	d(x)	x=c->x;
+#define	i(x)	x=c->x;
+#define	s(x)	if(!str(x,c->x))resub=1;x=c->x;
+   configfields;
+#undef	d
+#undef	i
+#undef	s
+#undef	str
+   u->quant.step = stempstep;   // Quantiser keeps its own copy
+   u->quant.hold = stemphold;
+   if (u->control)
+      u->control->mpc = controlmpc;     // Model kept, so switching back picks up where it was
+   if (c->zones)
+   {                            // Zones from file replace any we had
+      if (!zones)
+         resub = 1;
+      if (!config || zones != config->zones)
+         zonefree (zones);      // Not from config, e.g. --zones
+      zones = c->zones;
+   } else if (config && zones == config->zones)
+   {
+      zones = NULL;             // Zones removed from config
+      resub = 1;
+   }
+   configfree (config);         // Nothing uses old one now
+   config = c;
+   return resub;
+}
+#endif
 
 int
 main (int argc, const char *argv[])
 {
-#define c(x,t,v) char *set##x=NULL;     // Args
+#define c(x,...) char *set##x=NULL;     // Args
    controlfields;
 #undef	c
    // AC constants
+   const char *store = NULL;
+#ifdef LIBMQTT
+   int httpport = 0;
+   const char *httpbind = "localhost";
+   const char *zonefile = NULL;
+   int statusmaxage = 300;
+   const char *controllogic = "offset";
+   const char *benchdate = NULL;
+   const char *mqttformat = "json";
+#endif
 #ifdef SQLLIB
    const char *db = NULL;
    const char *table = "daikin";
    const char *svgdate = NULL;
-   int maxcmpfreq = 100;
-   int co2l = 400;              // Base CO2
-   int co2scale = 2;
-   int rhscale = 10;
-   int svgl = 2;                // Low C
-   int svgt = 32;               // High C
-   int svgc = 25;               // Per C spacing height
-   int svgh = 60;               // Per hour spacing width
-   int svgwidth = 24 * svgh;
-   int svgheight = (svgt - svgl) * svgc;
+   const char *journal = NULL;  // Journal for records when database not available
+   int journalsync = 60;
+   const char *svgto = NULL;
+   const char *svgdir = NULL;
+   int svgthreads = 4;
 #ifdef LIBSNMP
    const char *atempoid = "iso.3.6.1.4.1.42814.14.3.5.1.0";     // The nono temp sensors default
    const char *atempcommunity = "public";
@@ -420,13 +4247,13 @@ main (int argc, const char *argv[])
       modeheat = 0,
       modecool = 0,
       modedry = 0,
-      modefan = 0,
-      dolock = 0;
+      modefan = 0;
    int retries = 5;
+   fieldinit ();
    poptContext optCon;          // context for parsing command-line options
    {                            // POPT
       const struct poptOption optionsTable[] = {
-#define	c(x,t,v)	{#x, 0, POPT_ARG_STRING, &set##x, 0, #t, #v},
+#define	c(x,t,v,...)	{#x, 0, POPT_ARG_STRING, &set##x, 0, #t, #v},
          controlfields
 #undef c
 		 // *INDENT-OFF*
@@ -438,10 +4265,16 @@ main (int argc, const char *argv[])
          { "dry", 'D', POPT_ARG_NONE, &modedry, 0, "Dry"},
          { "fan", 'F', POPT_ARG_NONE, &modefan, 0, "Fan"},
          { "info", 'i', POPT_ARG_NONE, &info, 0, "Show info"},
+         { "store", 0, POPT_ARG_STRING, &store, 0, "Local time series store", "directory"},
 #ifdef SQLLIB
          { "log", 'l', POPT_ARG_STRING, &db, 0, "Log", "database"},
          { "table", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &table, 0, "Table", "table"},
          { "svg", 0, POPT_ARG_STRING, &svgdate, 0, "Make SVG", "YYYY-MM-DD"},
+         { "svg-to", 0, POPT_ARG_STRING, &svgto, 0, "Make SVGs up to", "YYYY-MM-DD"},
+         { "svg-dir", 0, POPT_ARG_STRING, &svgdir, 0, "Make SVGs as IP-YYYY-MM-DD.svg files in directory", "directory"},
+         { "svg-threads", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &svgthreads, 0, "Threads (each with database connection) for --svg-dir", "N"},
+         { "journal", 0, POPT_ARG_STRING, &journal, 0, "Journal to hold log records while database unavailable", "filename"},
+         { "journal-sync", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &journalsync, 0, "Journal fsync interval", "seconds"},
          { "sql-debug", 0, POPT_ARG_NONE, &sqldebug, 0, "Debug"},
 #endif
 #ifdef LIBMQTT
@@ -452,16 +4285,39 @@ main (int argc, const char *argv[])
          { "mqtt-topic", 't', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqtttopic, 0, "MQTT topic", "topic"},
          { "mqtt-cmnd", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqttcmnd, 0, "MQTT cmnd prefix", "prefix"},
          { "mqtt-tele", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqtttele, 0, "MQTT tele prefix", "prefix"},
+         { "mqtt-stat", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqttstat, 0, "MQTT stat prefix", "prefix"},
+         { "config", 0, POPT_ARG_STRING, &configfile, 0, "Config file for daemon, re-read on SIGHUP", "filename"},
+         { "zones", 0, POPT_ARG_STRING, &zonefile, 0, "Zones (name then IPs per line) for cmnd/zone/[name]/[field]", "filename"},
          { "mqtt-period", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &mqttperiod, 0, "MQTT reporting interval", "seconds"},
          { "mqtt-max-delay", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &mqttmaxdelay, 0, "MQTT reporting max delay", "seconds"},
          { "mqtt-debug", 0, POPT_ARG_NONE, &mqttdebug, 0, "Debug"},
-	 { "mqtt-atemp", 0, POPT_ARG_STRING , &mqttatemp, 0, "MQTT topic to subscribe for setting atemp", "topic"},
-	 { "mqtt-otemp", 0, POPT_ARG_STRING , &mqttotemp, 0, "MQTT topic to subscribe for setting otemp", "topic"},
-	 { "mqtt-rh", 0, POPT_ARG_STRING , &mqttrh, 0, "MQTT topic to subscribe for setting rh", "topic"},
-	 { "mqtt-co2", 0, POPT_ARG_STRING , &mqttco2, 0, "MQTT topic to subscribe for setting co2", "topic"},
+         { "snapshot", 0, POPT_ARG_NONE, &snapshot, 0, "Publish tele/estate/SNAPSHOT of all units' STATE each period"},
+         { "mqtt-format", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqttformat, 0, "MQTT STATE as JSON, CBOR, or both", "json/cbor/both"},
+         { "sensor-outlier", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &sensoroutlier, 0, "Ignore sensors this many deviations from median", "N"},
+	 { "mqtt-atemp", 0, POPT_ARG_STRING , &mqttatemp, 0, "MQTT topic(s) to subscribe for setting atemp", "topic [selector][;...]"},
+	 { "mqtt-otemp", 0, POPT_ARG_STRING , &mqttotemp, 0, "MQTT topic(s) to subscribe for setting otemp", "topic [selector][;...]"},
+	 { "mqtt-rh", 0, POPT_ARG_STRING , &mqttrh, 0, "MQTT topic(s) to subscribe for setting rh", "topic [selector][;...]"},
+	 { "mqtt-co2", 0, POPT_ARG_STRING , &mqttco2, 0, "MQTT topic(s) to subscribe for setting co2", "topic [selector][;...]"},
          { "max-samples", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &maxsamples, 0, "Max samples used for averaging", "N"},
          { "min-samples", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &minsamples, 0, "Min samples used for averaging", "N"},
-         { "lock", 0, POPT_ARG_NONE, &dolock, 0, "Lock operation"},
+         { "stemp-step", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &stempstep, 0, "Step that stemp is set in for automatic control", "C"},
+         { "stemp-hold", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &stemphold, 0, "Min time between stemp changes for automatic control", "seconds"},
+         { "control", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &controllogic, 0, "Automatic control logic", "offset/mpc"},
+         { "control-bench", 0, POPT_ARG_STRING, &benchdate, 0, "Compare automatic control logic on a logged day", "YYYY-MM-DD"},
+         { "mpc-horizon", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &mpchorizon, 0, "MPC samples to look ahead", "N"},
+         { "mpc-power", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &mpcpower, 0, "MPC cost of compressor per sample", "N"},
+         { "mpc-start", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &mpcstart, 0, "MPC cost of starting compressor", "N"},
+         { "poll-merge", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &pollmerge, 0, "Merge poll due within this time in to a command", "seconds"},
+         { "lock", 0, POPT_ARG_NONE, &dolock, 0, "Lock operation across processes (shared memory lock table)"},
+         { "http", 0, POPT_ARG_INT, &httpport, 0, "HTTP API port", "port"},
+         { "http-bind", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &httpbind, 0, "HTTP API address", "host"},
+         { "status-max-age", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &statusmaxage, 0, "Oldest state for cmnd/[topic]/status before a fresh poll", "seconds"},
+         { "history", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &historyhours, 0, "Recent history kept in memory", "hours"},
+         { "power-cap", 0, POPT_ARG_INT, &powercap, 0, "Total power for all units (seen on MQTT) to keep under", "W"},
+         { "power-priority", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &powerpriority, 0, "Priority for power cap, lowest eases off first", "N"},
+         { "power-stagger", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &powerstagger, 0, "Min time between compressor starts across units", "seconds"},
+         { "power-bias", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &powerbias, 0, "Target change when easing off for power cap", "C"},
+         { "state", 0, POPT_ARG_STRING, &statedir, 0, "Unit state (energy counters) kept in directory", "directory"},
 #endif
 #ifdef LIBSNMP
 	 { "atemp-oid", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &atempoid, 0, "SNMP temperature OID","OID"},
@@ -470,6 +4326,10 @@ main (int argc, const char *argv[])
 #endif
          { "curl-debug", 0, POPT_ARG_NONE, &curldebug, 0, "Debug"},
          { "curl-retries", 0, POPT_ARG_INT| POPT_ARGFLAG_SHOW_DEFAULT, &retries, 0, "HTTP retries to A/C"},
+         { "write-gap", 0, POPT_ARG_INT| POPT_ARGFLAG_SHOW_DEFAULT, &writegap, 0, "Min time between control writes to A/C", "seconds"},
+         { "fail-count", 0, POPT_ARG_INT| POPT_ARGFLAG_SHOW_DEFAULT, &unitfailmax, 0, "Failures in a row before not trying A/C for a while"},
+         { "fail-backoff", 0, POPT_ARG_INT| POPT_ARGFLAG_SHOW_DEFAULT, &unitbackoff, 0, "Time to not try A/C after failures, doubling each time", "seconds"},
+         { "fail-backoff-max", 0, POPT_ARG_INT| POPT_ARGFLAG_SHOW_DEFAULT, &unitbackoffmax, 0, "Max time to not try A/C", "seconds"},
          { "debug", 0, POPT_ARG_NONE, &debug, 0, "Debug"},
 	 POPT_AUTOHELP { }
 		 // *INDENT-ON*
@@ -496,18 +4356,39 @@ main (int argc, const char *argv[])
          setmode = "2";
       if (modefan)
          setmode = "6";
+#ifdef LIBMQTT
+      if (!strcmp (controllogic, "mpc"))
+         controlmpc = 1;
+      else if (strcmp (controllogic, "offset"))
+         errx (1, "Unknown control %s", controllogic);
+      if (!strcmp (mqttformat, "cbor"))
+      {
+         mqttjson = 0;
+         mqttcbor = 1;
+      } else if (!strcmp (mqttformat, "both"))
+         mqttcbor = 1;
+      else if (strcmp (mqttformat, "json"))
+         errx (1, "Unknown format %s", mqttformat);
+#endif
       // Power
       if (modeon)
          setpow = "1";
       if (modeoff)
          setpow = "0";
       CURL *curl = curl_easy_init ();
-      curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, 10L);
-      curl_easy_setopt (curl, CURLOPT_TIMEOUT, 60L);
       if (curldebug)
          curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
+      unit_t *locked = NULL;    // Unit we are talking to
       char *get (char *url)
       {                         // Get from URL (frees URL, malloced reply)
+         if (unitfastfail (locked))
+         {
+            if (debug)
+               warnx ("Not trying %s", url);
+            free (url);
+            return NULL;
+         }
+         curlsetup (curl, locked);
          curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
          curl_easy_setopt (curl, CURLOPT_URL, url);
          char *reply = NULL;
@@ -519,6 +4400,7 @@ main (int argc, const char *argv[])
          long code = 0;
          if (!result)
             curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &code);
+         unitresult (locked, curl, (code / 100) == 2);
          if ((code / 100) != 2)
          {
             syslog (LOG_INFO, "Failed %s", url);
@@ -538,294 +4420,160 @@ main (int argc, const char *argv[])
 #ifdef SQLLIB
       SQL sql;
       SQL_RES *fields = NULL;
-      if (db)
-      {                         // Database fields
-         sql_safe_connect (&sql, NULL, NULL, NULL, db, 0, NULL, 0);
-         fields = sql_safe_query_store_free (&sql, sql_printf ("SELECT * FROM `%#S` WHERE false", table));
-         sql_fetch_row (fields);
+      int dbup = 0;
+      int dbconnect (void)
+      {                         // Connect to database if not connected, return if up
+         if (dbup)
+            return 1;
+         if (!sql_connect (&sql, NULL, NULL, NULL, db, 0, NULL, 0))
+         {
+            syslog (LOG_INFO, "Database %s not available", db);
+            if (debug)
+               warnx ("Database %s not available", db);
+            return 0;
+         }
+         if (!fields)
+         {                      // Database fields
+            fields = sql_query_store_free (&sql, sql_printf ("SELECT * FROM `%#S` WHERE false", table));
+            if (!fields)
+            {
+               sql_close (&sql);
+               return 0;
+            }
+            sql_fetch_row (fields);
+         }
+         if (debug)
+            warnx ("Database %s connected", db);
+         return dbup = 1;
+      }
+      void dbdown (void)
+      {                         // Drop connection after error, reconnect later
+         if (!dbup)
+            return;
+         syslog (LOG_INFO, "Database %s failed: %s", db, sql_error (&sql));
+         if (debug)
+            warnx ("Database %s failed: %s", db, sql_error (&sql));
+         sql_close (&sql);
+         dbup = 0;
+      }
+      if (db && !dbconnect ())
+      {
+         if (svgdate && !store)
+            errx (1, "Cannot connect to database %s", db);
+         if (!journal)
+            warnx ("Database %s not available, not logging", db);
       }
 #endif
 
 #ifdef SQLLIB
       if (svgdate)
       {                         // Make an SVG for a date from the logs
-         if (!db)
-            errx (1, "No database");
+         if (!db && !store)
+            errx (1, "No database or store");
+         if (svgdir)
+         {                      // Batch, each unit and date to a file, in parallel
+            svgbatch_t b = {.db = db,.table = table,.store = store,.dir = svgdir };
+            const char *ip;
+            while ((ip = poptGetArg (optCon)))
+            {
+               b.ips = realloc (b.ips, (b.ipn + 1) * sizeof (*b.ips));
+               if (!b.ips)
+                  errx (1, "malloc");
+               b.ips[b.ipn++] = ip;
+            }
+            struct tm tm = { };
+            if (!strptime (svgdate, "%F", &tm))
+               errx (1, "Bad date %s", svgdate);
+            tm.tm_hour = 12;    // Safe from DST changes
+            tm.tm_isdst = -1;
+            char date[11];
+            while (1)
+            {
+               mktime (&tm);
+               strftime (date, sizeof (date), "%F", &tm);
+               if (svgto && strcmp (date, svgto) > 0)
+                  break;
+               if (b.daten >= 3660)
+                  errx (1, "Too many days");
+               b.dates = realloc (b.dates, (b.daten + 1) * sizeof (*b.dates));
+               if (!b.dates)
+                  errx (1, "malloc");
+               strcpy (b.dates[b.daten++], date);
+               if (!svgto)
+                  break;
+               tm.tm_mday++;
+            }
+            mkdir (svgdir, 0777);
+            if (svgthreads < 1)
+               svgthreads = 1;
+            pthread_t t[svgthreads];
+            int n;
+            for (n = 0; n < svgthreads; n++)
+               if (pthread_create (&t[n], NULL, svgworker, &b))
+                  errx (1, "Cannot create thread");
+            for (n = 0; n < svgthreads; n++)
+               pthread_join (t[n], NULL);
+            n = b.ipn * b.daten;
+            if (debug)
+               warnx ("%d SVGs made, %d failed", b.done, b.failed);
+            if (b.done + b.failed < n)
+               warnx ("%d SVGs not made", n - b.done - b.failed);
+            free (b.ips);
+            free (b.dates);
+            return b.done < n;
+         }
          const char *ip = NULL;
          while ((ip = poptGetArg (optCon)))
+            if (!svgmake (stdout, &sql, table, store, ip, svgdate))
+               errx (1, "Failed to make SVG for %s", ip);
+         return 0;
+      }
+#endif
+
+#ifdef LIBMQTT
+      if (benchdate)
+      {                         // Run automatic control logic on a day of logs
+         const char *ip = poptGetArg (optCon);
+         if (poptPeekArg (optCon))
+            errx (1, "One aircon only for --control-bench");
+         sample_t *r = NULL;
+         int n = 0;
+         void add (sample_t * s)
          {
-            xml_t svg = xml_tree_new ("svg");
-            xml_element_set_namespace (svg, xml_namespace (svg, NULL, "http://www.w3.org/2000/svg"));
-            xml_addf (svg, "@width", "%d", svgwidth + 1);
-            xml_addf (svg, "@height", "%d", svgheight + maxcmpfreq + 1);        // Allow for mompow and cmpfreq
-            // Graph data
-            int lastmode = 0,
-               lasty = 0;
-            double x = 0,
-               stempref = -1;
-            char lastf_rate = 0;
-            size_t atemplen = 0,
-               co2len = 0,
-               rhlen = 0,
-               htemplen = 0,
-               otemplen = 0,
-               mompowlen = 0,
-               cmpfreqlen = 0,
-               heatlen = 0,
-               heatblen = 0,
-               coollen = 0,
-               coolblen = 0,
-               dt1len = 0;
-            char *atempbuf = NULL,
-               *co2buf = NULL,
-               *rhbuf = NULL,
-               *htempbuf = NULL,
-               *otempbuf = NULL,
-               *mompowbuf = NULL,
-               *cmpfreqbuf = NULL,
-               *heatbuf = NULL,
-               *heatbbuf = NULL,
-               *coolbuf = NULL,
-               *coolbbuf = NULL,
-               *dt1buf = NULL;
-            char atempm = 'M',
-               co2m = 'M',
-               rhm = 'M',
-               htempm = 'M',
-               otempm = 'M',
-               mompowm = 'M',
-               cmpfreqm = 'M',
-               dt1m = 'M';
-            FILE *atemp = open_memstream (&atempbuf, &atemplen);
-            FILE *co2 = open_memstream (&co2buf, &co2len);
-            FILE *rh = open_memstream (&rhbuf, &rhlen);
-            FILE *htemp = open_memstream (&htempbuf, &htemplen);
-            FILE *otemp = open_memstream (&otempbuf, &otemplen);
-            FILE *mompow = open_memstream (&mompowbuf, &mompowlen);
-            FILE *cmpfreq = open_memstream (&cmpfreqbuf, &cmpfreqlen);
-            FILE *dt1 = open_memstream (&dt1buf, &dt1len);
-            FILE *heat = open_memstream (&heatbuf, &heatlen);
-            FILE *heatb = open_memstream (&heatbbuf, &heatblen);
-            FILE *cool = open_memstream (&coolbuf, &coollen);
-            FILE *coolb = open_memstream (&coolbbuf, &coolblen);
-            SQL_RES *res = sql_safe_query_store_free (&sql,
-                                                      sql_printf ("SELECT * FROM `%#S` WHERE `Updated` LIKE '%#S%%' AND `IP`=%#s",
-                                                                  table, svgdate, ip));
-            while (sql_fetch_row (res))
-            {
-               char *v = sql_col (res, "Updated");
-               if (strlen (v) < 19)
-                  continue;
-               x = (double) (atoi (v + 11) * 3600 + atoi (v + 14) * 60 + atoi (v + 17)) * svgh / 3600;
-               double d;
-               v = sql_col (res, "atemp");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (atemp, "%c%.2lf,%d", atempm, x, (int) (svgheight - (d - svgl) * svgc));
-                  atempm = 'L';
-               }
-               v = sql_col (res, "co2");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (co2, "%c%.2lf,%d", co2m, x, (int) (svgheight - (d - co2l) / co2scale));
-                  co2m = 'L';
-               }
-               v = sql_col (res, "rh");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (rh, "%c%.2lf,%d", rhm, x, (int) (svgheight - d * rhscale));
-                  rhm = 'L';
-               }
-               v = sql_col (res, "htemp");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (htemp, "%c%.2lf,%d", htempm, x, (int) (svgheight - (d - svgl) * svgc));
-                  htempm = 'L';
-               }
-               v = sql_col (res, "otemp");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (otemp, "%c%.2lf,%d", otempm, x, (int) (svgheight - (d - svgl) * svgc));
-                  otempm = 'L';
-               }
-               v = sql_col (res, "mompow");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (mompow, "%c%.2lf,%d", mompowm, x, (int) (svgheight + d));
-                  mompowm = 'L';
-               }
-               v = sql_col (res, "cmpfreq");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (cmpfreq, "%c%.2lf,%d", cmpfreqm, x, (int) (svgheight + maxcmpfreq - d));
-                  cmpfreqm = 'L';
-               }
-               v = sql_col (res, "dt1");
-               if (v)
-               {
-                  d = strtod (v, NULL);
-                  fprintf (dt1, "%c%.2lf,%d", dt1m, x, (int) (svgheight - (d - svgl) * svgc));
-                  dt1m = 'L';
-               }
-               v = sql_col (res, "stemp");
-               char f_rate = *sql_colz (res, "f_rate");
-               int pow = atoi (sql_colz (res, "pow"));
-               int mode = atoi (sql_colz (res, "mode"));
-               if (!pow)
-                  mode = -1;    // Not on
-               if ((lastf_rate != f_rate || mode != lastmode) && stempref >= 0)
-               {                // Close box
-                  if (lastmode == 3)
-                     fprintf (lastf_rate == 'B' ? coolb : cool, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, 0, stempref, 0);
-                  if (lastmode == 4)
-                     fprintf (lastf_rate == 'B' ? heatb : heat, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, svgheight, stempref,
-                              svgheight);
-                  stempref = -1;
-               }
-               if (mode == 3 || mode == 4)
-               {
-                  FILE *f = (mode == 3 ? f_rate == 'B' ? coolb : cool : f_rate == 'B' ? heatb : heat);
-                  d = strtod (v, NULL);
-                  if (stempref >= 0)
-                     fprintf (f, "L%.2lf,%dL", x, lasty);
-                  else
-                     fprintf (f, "M");
-                  fprintf (f, "%.2lf,%d", x, lasty = (int) (svgheight - (d - svgl) * svgc));
-                  if (stempref < 0)
-                     stempref = x;
-               }
-               lastmode = mode;
-               lastf_rate = f_rate;
-            }
-            x += svgh / 60;     // Assume minute stats to draw last bar
-            if (lastmode == 3)
-               fprintf (lastf_rate == 'B' ? coolb : cool, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, 0, stempref, 0);
-            if (lastmode == 4)
-               fprintf (lastf_rate == 'B' ? heatb : heat, "L%.2lf,%dL%.2lf,%dL%.2lf,%dZ", x, lasty, x, svgheight, stempref,
-                        svgheight);
-            fclose (atemp);
-            fclose (co2);
-            fclose (rh);
-            fclose (htemp);
-            fclose (otemp);
-            fclose (mompow);
-            fclose (cmpfreq);
-            fclose (dt1);
-            fclose (heat);
-            fclose (heatb);
-            fclose (cool);
-            fclose (coolb);
-            xml_addf (svg, "+path@fill=red@stroke=none@opacity=0.5@d", heatbuf);
-            xml_addf (svg, "+path@fill=red@stroke=none@opacity=0.25@d", heatbbuf);
-            xml_addf (svg, "+path@fill=blue@stroke=none@opacity=0.5@d", coolbuf);
-            xml_addf (svg, "+path@fill=blue@stroke=none@opacity=0.25@d", coolbbuf);
-            xml_addf (svg, "+path@fill=none@stroke=red@stroke-linecap=round@stroke-linejoin=round@d", atempbuf);
-            xml_addf (svg, "+path@fill=none@stroke=orange@stroke-linecap=round@stroke-linejoin=round@d", co2buf);
-            xml_addf (svg, "+path@fill=none@stroke=cyan@stroke-linecap=round@stroke-linejoin=round@d", rhbuf);
-            xml_addf (svg, "+path@fill=none@stroke=green@stroke-linecap=round@stroke-linejoin=round@d", htempbuf);
-            xml_addf (svg, "+path@fill=none@stroke=blue@stroke-linecap=round@stroke-linejoin=round@d", otempbuf);
-            xml_addf (svg, "+path@fill=none@stroke=black@stroke-linecap=round@stroke-linejoin=round@d", mompowbuf);
-            xml_addf (svg, "+path@fill=none@stroke=green@@opacity=0.5@stroke-linecap=round@stroke-linejoin=round@d", cmpfreqbuf);
-            xml_addf (svg, "+path@fill=none@stroke=black@stroke-dasharray=1@d", dt1buf);
+            const int need = SBIT (atemp) | SBIT (otemp) | SBIT (stemp) | SBIT (dt1) | SBIT (cmpfreq) | SBIT (mode) | SBIT (pow);
+            if ((s->present & need) != need || (n && s->updated <= r[n - 1].updated))
+               return;
+            if (!(n & 1023) && !(r = realloc (r, (n + 1024) * sizeof (*r))))
+               errx (1, "malloc");
+            r[n++] = *s;
+         }
+         if (store)
+            storeread (store, ip, benchdate, add);
+#ifdef SQLLIB
+         else if (db && dbup)
+         {
+            SQL_RES *res = sql_query_store_free (&sql,
+                                                 sql_printf
+                                                 ("SELECT * FROM `%#S` WHERE `Updated` LIKE '%#S%%' AND `IP`=%#s ORDER BY `Updated`",
+                                                  table, benchdate, ip));
+            if (res)
             {
-               int x,
-                 y;
-               // Time
-               for (x = 0; x < svgwidth + 1; x += svgh)
+               while (sql_fetch_row (res))
                {
-                  xml_addf (svg, "+path@stroke=grey@fill=none@opacity=0.5@stroke-dasharray=1@stroke-width=0.5@d", "M%d 0v%d", x,
-                            svgheight + maxcmpfreq);
-                  xml_t t = xml_addf (svg, "+text", "%02d", (x / svgh) % 24);
-                  xml_addf (t, "@x", "%d", x);
-                  xml_addf (t, "@y", "%d", svgheight);
-                  xml_add (t, "@text-anchor", "middle");
-               }
-               // Lines
-               for (y = svgc; y < svgheight; y += svgc)
-                  xml_addf (svg, "+path@stroke=grey@fill=none@opacity=0.5@stroke-dasharray=1@stroke-width=0.5@d", "M0 %dh%d",
-                            svgheight - y, svgwidth);
-               if (*atempbuf || *otempbuf || *htempbuf)
-               {                // Temp scale
-                  for (y = svgc; y < svgheight; y += svgc)
-                  {
-                     xml_t t = xml_addf (svg, "+text", "%d", y / svgc + svgl);
-                     xml_addf (t, "@opacity", "0.5");
-                     xml_addf (t, "@fill", "red");
-                     xml_addf (t, "@text-anchor", "end");
-                     xml_addf (t, "@x", "%d", 20);
-                     xml_addf (t, "@y", "%d", svgheight - y);
-                     xml_add (t, "@alignment-baseline", "middle");
-                  }
-                  xml_t t = xml_add (svg, "+text", "℃");
-                  xml_addf (t, "@opacity", "0.5");
-                  xml_addf (t, "@fill", "red");
-                  xml_addf (t, "@text-anchor", "end");
-                  xml_addf (t, "@x", "%d", 20);
-                  xml_addf (t, "@y", "%d", 12);
-               }
-               if (*co2buf)
-               {                // CO2 scale
-                  for (y = svgc; y < svgheight; y += svgc)
-                  {
-                     xml_t t = xml_addf (svg, "+text", "%d", y * co2scale + co2l);
-                     xml_addf (t, "@opacity", "0.5");
-                     xml_addf (t, "@fill", "orange");
-                     xml_addf (t, "@text-anchor", "end");
-                     xml_addf (t, "@x", "%d", 60);
-                     xml_addf (t, "@y", "%d", svgheight - y);
-                     xml_add (t, "@alignment-baseline", "middle");
-                  }
-                  xml_t t = xml_add (svg, "+text", "CO₂");
-                  xml_addf (t, "@opacity", "0.5");
-                  xml_addf (t, "@fill", "orange");
-                  xml_addf (t, "@text-anchor", "end");
-                  xml_addf (t, "@x", "%d", 60);
-                  xml_addf (t, "@y", "%d", 12);
-               }
-               if (*rhbuf)
-               {                // RH scale
-                  for (y = svgc; y < svgheight; y += svgc)
-                  {
-                     xml_t t = xml_addf (svg, "+text", "%d", y / rhscale);
-                     xml_addf (t, "@opacity", "0.5");
-                     xml_addf (t, "@fill", "cyan");
-                     xml_addf (t, "@text-anchor", "end");
-                     xml_addf (t, "@x", "%d", 90);
-                     xml_addf (t, "@y", "%d", svgheight - y);
-                     xml_add (t, "@alignment-baseline", "middle");
-                  }
-                  xml_t t = xml_add (svg, "+text", "RH");
-                  xml_addf (t, "@opacity", "0.5");
-                  xml_addf (t, "@fill", "cyan");
-                  xml_addf (t, "@text-anchor", "end");
-                  xml_addf (t, "@x", "%d", 90);
-                  xml_addf (t, "@y", "%d", 12);
+                  sample_t s;
+                  sqlsample (res, &s);
+                  add (&s);
                }
+               sql_free_result (res);
             }
-            free (atempbuf);
-            free (co2buf);
-            free (rhbuf);
-            free (htempbuf);
-            free (otempbuf);
-            free (mompowbuf);
-            free (cmpfreqbuf);
-            free (dt1buf);
-            free (heatbuf);
-            free (heatbbuf);
-            free (coolbuf);
-            free (coolbbuf);
-            sql_free_result (res);
-            sql_close (&sql);
-            xml_write (stdout, svg);
-            xml_tree_delete (svg);
          }
+#endif
+         else
+            errx (1, "No store or database");
+         if (n < 2)
+            errx (1, "No logs for %s on %s", ip, benchdate);
+         controlbench (r, n);
+         free (r);
          return 0;
       }
 #endif
@@ -863,6 +4611,7 @@ main (int argc, const char *argv[])
       int thiscmpfreq = 0;
       int thismode = 0;
       double thisstemp = 0,
+         thisotemp = NAN,
       thisdt[10] = { };
       char thisf_rate = 0;
       time_t atempset = 0;      // Time last set
@@ -875,9 +4624,14 @@ main (int argc, const char *argv[])
       double rh = 0;
 #endif
       const char *ip;
-#define c(x,t,v) char *x=NULL;  // Current settings
+#define c(x,...) char *x=NULL;  // Current settings
       controlfields;
 #undef	c
+      char **settings[CONTROLS] = {     // Current settings by field
+#define c(x,...) &x,
+         controlfields
+#undef	c
+      };
 #if	defined(SQLLIB) || defined(LIBMQTT)
       typedef void found_t (char *tag, char *val);
       void scan (char *reply, found_t * found)
@@ -905,29 +4659,16 @@ main (int argc, const char *argv[])
          }
       }
 #endif
-      int lock = -1;
       // Get status
       int getstatus (void)
       {
-         if (dolock)
-         {
-            char *fn = NULL;
-            if (asprintf (&fn, "/tmp/daikinac-%s", ip) < 0)
-               errx (1, "malloc");
-            lock = open (fn, O_CREAT, 0777);
-            if (lock < 0)
-            {
-               warn ("Cannot make lock file %s", fn);
-               free (fn);
-               return 0;        // Uh?
-            }
-            free (fn);
-            flock (lock, LOCK_EX);
-         }
+         if (!locked)
+            unitlock (locked = unitfind (ip));
          // Reset
          changed = 0;
 #ifdef	LIBMQTT
          thisstemp = 0;
+         thisotemp = NAN;
          thisf_rate = 0;
          memset (&thisdt, 0, sizeof (thisdt));
          thispow = 0;
@@ -957,8 +4698,9 @@ main (int argc, const char *argv[])
                   {
                      if (!strncmp (temp, "STRING: \"", 9))
                      {          // Really, this is crap!
-                        double v = strtod (temp + 9, NULL);
-                        if (v)
+                        char *e;
+                        double v = strtod (temp + 9, &e);
+                        if (e > temp + 9 && sensorreading (SENSOR_atemp, "snmp", 1, v, time (0), &v))
                         {
                            atemp = v;
                            atempset = time (0);
@@ -981,8 +4723,10 @@ main (int argc, const char *argv[])
             if (asprintf (&url, "http://%s/aircon/get_sensor_info", ip) < 0)
                errx (1, "malloc");
             sensor = get (url);
-            if (sensor)
+            if (sensor || unitfastfail (locked))
                break;
+            if (tries)
+               usleep (100000 << (retries - tries - 1 < 4 ? retries - tries - 1 : 4));  // Short backoff
          }
          if (!sensor)
             return 0;
@@ -992,23 +4736,23 @@ main (int argc, const char *argv[])
             if (asprintf (&url, "http://%s/aircon/get_control_info", ip) < 0)
                errx (1, "malloc");
             control = get (url);
-            if (control)
+            if (control || unitfastfail (locked))
                break;
+            if (tries)
+               usleep (100000 << (retries - tries - 1 < 4 ? retries - tries - 1 : 4));  // Short backoff
          }
          if (!control)
             return 0;
+         free (locked->shadow);
+         locked->shadow = controlnorm (control);        // What the unit has now
          return 1;              // OK
       }
       void freestatus (void)
       {
-         if (dolock)
+         if (locked)
          {
-            if (lock >= 0)
-            {
-               flock (lock, LOCK_UN);
-               close (lock);
-               lock = -1;
-            }
+            unitunlock (locked);
+            locked = NULL;
          }
          if (sensor)
          {
@@ -1020,7 +4764,7 @@ main (int argc, const char *argv[])
             free (control);
             control = NULL;
          }
-#define	c(x,t,v) if(x)free(x);x=NULL;
+#define	c(x,...) if(x)free(x);x=NULL;
          controlfields;
 #undef c
       }
@@ -1032,27 +4776,45 @@ main (int argc, const char *argv[])
          {
             if (info && strcmp (tag, "ret"))
                printf ("%s\t%s\n", tag, val);
-#define	c(x,t,v) if(!strcmp(#x,tag))if(val&&(!x||strcmp(x,val))){if(x)free(x);x=strdup(val);}
-            controlfields;
-#undef c
+            int f = fieldfind (tag);
+            if (f < 0)
+               return;
+            if (f < CONTROLS && val && (!*settings[f] || strcmp (*settings[f], val)))
+            {                   // Setting
+               if (*settings[f])
+                  free (*settings[f]);
+               *settings[f] = strdup (val);
+            }
             // Note some settings
-            if (!strcmp (tag, "pow"))
-               thispow = atoi (val);
-            else if (!strcmp (tag, "mode"))
+            switch (f)
             {
+            case FIELD_pow:
+               thispow = atoi (val);
+               break;
+            case FIELD_mode:
                thismode = atoi (val);
                if (thismode < 0 || thismode >= sizeof (modename) / sizeof (*modename))
                   thismode = 0;
-            } else if (!strcmp (tag, "cmpfreq"))
+               break;
+            case FIELD_cmpfreq:
                thiscmpfreq = atoi (val);
-            else if (!strcmp (tag, "mompow"))
+               break;
+            case FIELD_mompow:
                thismompow = atoi (val);
-            else if (!strcmp (tag, "f_rate"))
+               break;
+            case FIELD_f_rate:
                thisf_rate = *val;
-            else if (!strcmp (tag, "stemp"))
+               break;
+            case FIELD_stemp:
                thisstemp = strtod (val, NULL);
-            else if (!strncmp (tag, "dt", 2) && isdigit (tag[2]))
-               thisdt[tag[2] - '0'] = strtod (val, NULL);
+               break;
+            case FIELD_otemp:
+               thisotemp = strtod (val, NULL);
+               break;
+            case FIELD_dt1 ... FIELD_dt7:
+               thisdt[f - FIELD_dt1 + 1] = strtod (val, NULL);
+               break;
+            }
          }
          scan (sensor, check);
          scan (control, check);
@@ -1060,55 +4822,456 @@ main (int argc, const char *argv[])
 #else
 #define	updatestatus(s,c)
 #endif
-      void updatesettings ()
-      {                         // Set new control
+      char *settingsurl (void)
+      {                         // URL to set current control settings
          char *url = NULL;
          size_t len = 0;
          FILE *o = open_memstream (&url, &len);
          fprintf (o, "http://%s/aircon/set_control_info?", ip);
-#define c(x,t,v) fprintf(o,"%s=%s&",#x,x);
+#define c(x,...) fprintf(o,"%s=%s&",#x,x);
          controlfields;
 #undef c
          fclose (o);
          url[--len] = 0;
-         char *ok = get (url);
+         return url;
+      }
+      char *set (char *url)
+      {                         // Set control (frees URL, malloced reply), not sent if the unit already has these settings
+         unit_t *u = unitfind (ip);
+         char *norm = controlnorm (strchr (url, '?'));
+         if (u->shadow && !strcmp (u->shadow, norm))
+         {
+            if (debug)
+               warnx ("No change, not sending %s", url);
+            free (norm);
+            free (url);
+            return NULL;
+         }
+         if (time (0) < u->written + writegap)
+         {                      // Not too often, daemon jobs wait for the gap before getting here
+            if (debug)
+               warnx ("Too soon to write %s", url);
+            free (norm);
+            free (url);
+            return NULL;
+         }
+         char *reply = get (url);
+         u->written = time (0);
+         free (u->shadow);
+         u->shadow = NULL;      // Not known, unless it worked
+         if (reply && strstr (reply, "ret=OK"))
+            u->shadow = norm;
+         else
+            free (norm);
+         return reply;
+      }
+      void updatesettings ()
+      {                         // Set new control
+         char *ok = set (settingsurl ());
+         if (ok)
+            free (ok);
+      }
+
+#ifdef	LIBMQTT
+      int deferlog = 0;         // Queue logging as a low priority job
+#endif
+#ifdef SQLLIB
+      // Log records are a line of time, IP, then tag=value for each field, tab separated
+      // These go straight to the database, or if it is not available, on the end of the journal to be replayed later
+      typedef void record_t (char *tag, char *val);
+      int recordscan (char *rec, time_t * tp, char **ipp, record_t * found)
+      {                         // Split record (in place), time and IP set before any fields found, return 0 if not valid
+         char *p = strchr (rec, '\n');
+         if (p)
+            *p = 0;
+         p = strchr (rec, '\t');
+         if (!p)
+            return 0;
+         *p++ = 0;
+         *tp = strtol (rec, NULL, 10);
+         *ipp = p;
+         p = strchr (p, '\t');
+         if (p)
+            *p++ = 0;
+         while (p && *p)
+         {
+            char *tag = p;
+            p = strchr (p, '\t');
+            if (p)
+               *p++ = 0;
+            char *val = strchr (tag, '=');
+            if (val)
+            {
+               *val++ = 0;
+               found (tag, val);
+            }
+         }
+         return *tp && **ipp;
+      }
+      int dbinsert (const char *rec)
+      {                         // Insert a record, return 0 if failed
+         time_t t;
+         char *rip;
+         char *copy = strdup (rec);
+         sql_string_t s = {
+         };
+         int found = 0;
+         void add (char *tag, char *val)
+         {
+            if (!found++)
+               sql_sprintf (&s, "INSERT INTO `%#S` SET `ip`=%#s,`Updated`=FROM_UNIXTIME(%ld)", table, rip, (long) t);
+            if (sql_colnum (fields, tag) >= 0)
+               sql_sprintf (&s, ",`%#S`=%#s", tag, val);
+         }
+         recordscan (copy, &t, &rip, add);
+         free (copy);
+         if (!found)
+            return 1;           // Nothing to log
+         if (sql_query_s (&sql, &s))
+         {
+            dbdown ();
+            return 0;
+         }
+         return 1;
+      }
+      int journalfd = -1;       // Appending
+      time_t journalsynced = 0;
+      off_t journaldone = 0;    // How far we have replayed
+      int journalpending (void)
+      {
+         struct stat st;
+         return journal && !stat (journal, &st) && st.st_size > journaldone;
+      }
+      void journalappend (const char *rec)
+      {                         // Sequential write, with periodic sync
+         if (journalfd < 0 && (journalfd = open (journal, O_WRONLY | O_APPEND | O_CREAT, 0666)) < 0)
+         {
+            syslog (LOG_INFO, "Cannot open journal %s, record lost", journal);
+            warn ("Cannot open journal %s", journal);
+            return;
+         }
+         flock (journalfd, LOCK_EX);    // Others may be appending, or we may be truncating after replay
+         if (write (journalfd, rec, strlen (rec)) < 0)
+         {
+            syslog (LOG_INFO, "Cannot write journal %s, record lost", journal);
+            warn ("Cannot write journal %s", journal);
+         }
+         flock (journalfd, LOCK_UN);
+         time_t now = time (0);
+         if (now - journalsynced >= journalsync)
+         {
+            fdatasync (journalfd);
+            journalsynced = now;
+         }
+      }
+      int journalreplay (void)
+      {                         // Bulk load next chunk of journal in to database, return 1 if more to do
+#define	JOURNALCHUNK	1000
+#define	JOURNALROWS	100
+         if (!dbconnect ())
+            return 0;
+         int fd = open (journal, O_RDWR);
+         if (fd < 0)
+            return 0;
+         char *line[JOURNALCHUNK];
+         int lines = 0;
+         FILE *f = fdopen (fd, "r");
+         flock (fd, LOCK_EX);
+         struct stat st;
+         if (!fstat (fd, &st) && st.st_size < journaldone)
+            journaldone = 0;    // Truncated under us
+         fseeko (f, journaldone, SEEK_SET);
+         off_t end = journaldone;
+         while (lines < JOURNALCHUNK)
+         {
+            char *l = NULL;
+            size_t len = 0;
+            ssize_t n = getline (&l, &len, f);
+            if (n <= 0 || l[n - 1] != '\n')
+            {                   // End, or partial record
+               free (l);
+               break;
+            }
+            l[n - 1] = 0;
+            line[lines++] = l;
+            end += n;
+         }
+         flock (fd, LOCK_UN);
+         int ok = 1;
+         if (lines)
+         {
+            time_t t[JOURNALCHUNK],
+              min = 0,
+               max = 0;
+            char *rip[JOURNALCHUNK];
+            char *tags[JOURNALCHUNK];
+            char *vals[JOURNALCHUNK];
+            int l;
+            for (l = 0; l < lines; l++)
+            {                   // Parse, keeping the fields we have columns for
+               size_t tlen = 0,
+                  vlen = 0;
+               FILE *to = open_memstream (&tags[l], &tlen);
+               FILE *vo = open_memstream (&vals[l], &vlen);
+               void add (char *tag, char *val)
+               {
+                  if (sql_colnum (fields, tag) < 0)
+                     return;
+                  fprintf (to, "\t%s", tag);
+                  fprintf (vo, "\t%s", val);
+               }
+               if (!recordscan (line[l], &t[l], &rip[l], add))
+                  t[l] = 0;
+               fclose (to);
+               fclose (vo);
+               if (t[l] && (!min || t[l] < min))
+                  min = t[l];
+               if (t[l] > max)
+                  max = t[l];
+            }
+            // Records already in the database, e.g. if we failed part way through a replay before
+            char **have = NULL;
+            int haves = 0;
+            SQL_RES *res = NULL;
+            if (min)
+               res =
+                  sql_query_store_free (&sql,
+                                        sql_printf
+                                        ("SELECT `ip`,UNIX_TIMESTAMP(`Updated`) AS `t` FROM `%#S` WHERE `Updated`>=FROM_UNIXTIME(%ld) AND `Updated`<=FROM_UNIXTIME(%ld)",
+                                         table, (long) min, (long) max));
+            if (min && !res)
+               ok = 0;
+            if (res)
+            {
+               while (sql_fetch_row (res))
+               {
+                  char *h = NULL;
+                  if (asprintf (&h, "%s\t%s", sql_colz (res, "t"), sql_colz (res, "ip")) < 0)
+                     errx (1, "malloc");
+                  have = realloc (have, (haves + 1) * sizeof (*have));
+                  if (!have)
+                     errx (1, "malloc");
+                  have[haves++] = h;
+               }
+               sql_free_result (res);
+            }
+            int dup (int l)
+            {
+               int n;
+               for (n = 0; n < haves; n++)
+               {
+                  char *p = have[n];
+                  if (strtol (p, &p, 10) == t[l] && *p++ == '\t' && !strcmp (p, rip[l]))
+                     return 1;
+               }
+               return 0;
+            }
+            void each (char *list, void (*found) (char *))
+            {                   // Tab separated list (with leading tab), restored after
+               while (*list == '\t')
+               {
+                  char *e = strchr (++list, '\t');
+                  if (e)
+                     *e = 0;
+                  found (list);
+                  if (!e)
+                     break;
+                  *e = '\t';
+                  list = e;
+               }
+            }
+            // Multi row inserts, grouping consecutive records with the same fields, all in one transaction
+            sql_string_t s = {
+            };
+            char *cols = NULL;
+            int rows = 0,
+               loaded = 0,
+               skipped = 0;
+            void flush (void)
+            {
+               if (!rows)
+                  return;
+               if (sql_query_s (&sql, &s))
+                  ok = 0;
+               memset (&s, 0, sizeof (s));
+               rows = 0;
+            }
+            if (ok && sql_query (&sql, "START TRANSACTION"))
+               ok = 0;
+            for (l = 0; ok && l < lines; l++)
+            {
+               if (!t[l] || dup (l))
+               {
+                  skipped++;
+                  continue;
+               }
+               if (rows >= JOURNALROWS || !cols || strcmp (cols, tags[l]))
+               {                // New insert
+                  flush ();
+                  cols = tags[l];
+                  sql_sprintf (&s, "INSERT INTO `%#S` (`ip`,`Updated`", table);
+                  void col (char *tag)
+                  {
+                     sql_sprintf (&s, ",`%#S`", tag);
+                  }
+                  each (tags[l], col);
+                  sql_sprintf (&s, ") VALUES ");
+               } else
+                  sql_sprintf (&s, ",");
+               sql_sprintf (&s, "(%#s,FROM_UNIXTIME(%ld)", rip[l], (long) t[l]);
+               void val (char *val)
+               {
+                  sql_sprintf (&s, ",%#s", val);
+               }
+               each (vals[l], val);
+               sql_sprintf (&s, ")");
+               rows++;
+               loaded++;
+            }
+            flush ();
+            if (ok && sql_query (&sql, "COMMIT"))
+               ok = 0;
+            if (!ok)
+            {
+               sql_query (&sql, "ROLLBACK");
+               dbdown ();
+            } else if (debug)
+               warnx ("Journal replayed %d records (%d already in database)", loaded, skipped);
+            for (l = 0; l < haves; l++)
+               free (have[l]);
+            free (have);
+            for (l = 0; l < lines; l++)
+            {
+               free (tags[l]);
+               free (vals[l]);
+            }
+         }
+         while (lines--)
+            free (line[lines]);
+         int more = 0;
          if (ok)
-            free (ok);
+         {                      // Done this chunk
+            journaldone = end;
+            flock (fd, LOCK_EX);
+            if (!fstat (fd, &st) && st.st_size <= journaldone)
+            {                   // All done, and nothing new added
+               if (ftruncate (fd, 0))
+                  warn ("Cannot truncate journal %s", journal);
+               journaldone = 0;
+            } else
+               more = 1;
+            flock (fd, LOCK_UN);
+         }
+         fclose (f);
+         return more;
+#undef	JOURNALROWS
+#undef	JOURNALCHUNK
       }
-
+      void dblog (char *rec)
+      {                         // Log a record
+         if (journalpending ())
+            journalappend (rec);        // Keep in order, after what is waiting to be replayed
+         else if (!dbconnect () || !dbinsert (rec))
+         {
+            if (journal)
+               journalappend (rec);     // Still whole, as dbinsert works on a copy
+            else
+               syslog (LOG_INFO, "Database %s not available, record lost", db);
+         }
+#ifdef	LIBMQTT
+         if (deferlog && journalpending ())
+            jobadd (JOB_LOG, "replay", NULL);
+#endif
+      }
+#endif
       void updatedb (void)
       {
+         time_t now = time (0);
+         {                      // Sample
+            sample_t r = {.updated = now };
+            void add (char *tag, char *val)
+            {
+               int f = fieldfind (tag);
+               if (f >= 0 && f < CONTROLS && *settings[f])
+                  val = *settings[f];   // Use the setting we now have
+               sampleset (&r, tag, val);
+            }
+            scan (sensor, add);
+            scan (control, add);
+#ifdef	LIBMQTT
+            if (mqttotemp)
+               r.present &= ~SBIT (otemp);
+#define	s(x)	if(x##set){r.x=x;r.present|=SBIT(x);}
+            s (atemp);
+            s (otemp);
+            s (co2);
+            s (rh);
+#undef s
+            unit_t *u = unitfind (ip);
+            if (u->hist)
+               historyadd (u->hist, &r);
+#endif
+            if (store)
+               storewrite (store, ip, &r);   // Local store
+         }
 #ifdef SQLLIB
          if (!db)
             return;
-         sql_string_t s = {
-         };
-         sql_sprintf (&s, "INSERT INTO `%#S` SET `ip`=%#s", table, ip);
+         char *rec = NULL;
+         size_t len = 0;
+         FILE *o = open_memstream (&rec, &len);
+         fprintf (o, "%ld\t%s", (long) now, ip);
+         void add (const char *tag, const char *val)
+         {
+            if (fields && sql_colnum (fields, tag) < 0)
+               return;          // Only log fields we have (if we know yet)
+            fprintf (o, "\t%s=", tag);
+            for (; *val; val++)
+               fputc (*val == '\t' || *val == '\n' ? ' ' : *val, o);
+         }
          void update (char *tag, char *val)
          {
-            int f = sql_colnum (fields, tag);
-            if (f < 0)
-               return;
-#define c(x,t,v) if(!strcmp(#x,tag)&&x)val=x;   // Use the setting we now have
-            controlfields;
-#undef c
-            if (!strcmp (tag, "otemp") && mqttotemp)
+            int f = fieldfind (tag);
+            if (f >= 0 && f < CONTROLS && *settings[f])
+               val = *settings[f];      // Use the setting we now have
+#ifdef	LIBMQTT
+            if (f == FIELD_otemp && mqttotemp)
                return;
-            sql_sprintf (&s, ",`%#S`=%#s", tag, val);
+#endif
+            add (tag, val);
          }
          scan (sensor, update);
          scan (control, update);
 #ifdef	LIBMQTT
-         if (atempset && sql_colnum (fields, "atemp") >= 0)
-            sql_sprintf (&s, ",`atemp`=%.1lf", atemp);
-         if (otempset && sql_colnum (fields, "otemp") >= 0)
-            sql_sprintf (&s, ",`otemp`=%.1lf", otemp);
-         if (co2set && sql_colnum (fields, "co2") >= 0)
-            sql_sprintf (&s, ",`co2`=%.1lf", co2);
-         if (rhset && sql_colnum (fields, "rh") >= 0)
-            sql_sprintf (&s, ",`rh`=%.1lf", rh);
+         if (atempset)
+            fprintf (o, "\tatemp=%.1lf", atemp);
+         if (otempset)
+            fprintf (o, "\totemp=%.1lf", otemp);
+         if (co2set)
+            fprintf (o, "\tco2=%.1lf", co2);
+         if (rhset)
+            fprintf (o, "\trh=%.1lf", rh);
+         unit_t *u = unitfind (ip);
+         if (u->energy && u->energy->last)
+         {                      // Running counters, if the table has them
+            char v[40];
+            sprintf (v, "%.3lf", u->energy->total.kwh);
+            add ("kwh", v);
+            sprintf (v, "%llu", u->energy->total.run);
+            add ("run", v);
+            sprintf (v, "%llu", u->energy->total.starts);
+            add ("starts", v);
+         }
+#endif
+         fprintf (o, "\n");
+         fclose (o);
+#ifdef	LIBMQTT
+         if (deferlog)
+            jobadd (JOB_LOG, NULL, rec);
+         else
 #endif
-         sql_safe_query_s (&sql, &s);
+            dblog (rec);
+         free (rec);
 #endif
       }
 
@@ -1116,115 +5279,610 @@ main (int argc, const char *argv[])
       if (mqtthost)
       {                         // Handling MQTT only
          openlog ("daikinac", LOG_CONS | LOG_PID, LOG_USER);
+         signal (SIGPIPE, SIG_IGN);     // Write errors (e.g. HTTP client gone) are handled where they happen
          ip = poptGetArg (optCon);
          if (poptPeekArg (optCon))
             errx (1, "One aircon only for MQTT operation");
+         unit_t *unit = unitfind (ip);
+         unit->hist = historynew (historyhours);
+         unit->quant.step = stempstep;
+         unit->quant.hold = stemphold;
+         if (!(unit->energy = calloc (1, sizeof (*unit->energy))))
+            errx (1, "malloc");
+         if (!(unit->control = calloc (1, sizeof (*unit->control))))
+            errx (1, "malloc");
+         unit->control->mpc = controlmpc;
+         if (statedir)
+         {
+            mkdir (statedir, 0777);
+            energyload (statedir, ip, unit->energy);
+         }
+         srandom (time (0) ^ getpid ());   // Backoff jitter
+         if (zonefile)
+            zoneload (zonefile);
+         if (configfile)
+         {                      // Config on top of command line
+            configbase = confignow ();
+            config_t *c = configread (configfile, ip);
+            if (!c)
+               errx (1, "Config %s not valid", configfile);
+            configapply (c, unit);
+            struct sigaction sa = {.sa_handler = confighup,.sa_flags = SA_RESTART };
+            sigaction (SIGHUP, &sa, NULL);
+         }
+         {                      // Load recent history, and re-run it so auto can catch up to current state
+            time_t from = time (0) - 86400;
+            void load (sample_t * r)
+            {
+               if (r->updated >= from)
+                  historyadd (unit->hist, r);
+            }
+            void warm (sample_t * r)
+            {
+               if (!(r->present & SBIT (atemp)))
+                  return;
+               atemp = r->atemp;
+               if ((r->present & (SBIT (stemp) | SBIT (dt1) | SBIT (cmpfreq))) != (SBIT (stemp) | SBIT (dt1) | SBIT (cmpfreq)))
+                  return;
+               double stemp = r->stemp;
+               int mode = r->mode;
+               char f_rate = r->f_rate;
+               atempset = r->updated;
+               docontrol (unit->control, &stemp, &f_rate, &mode, r->pow, r->cmpfreq, r->mompow, atempset, atemp,
+                          r->present & SBIT (otemp) ? r->otemp : NAN, r->dt1);
+            }
+            if (store)
+            {                   // Yesterday and today
+               time_t t;
+               for (t = from; t < from + 86400 * 2; t += 86400)
+               {
+                  struct tm tm;
+                  localtime_r (&t, &tm);
+                  char date[11];
+                  strftime (date, sizeof (date), "%F", &tm);
+                  storeread (store, ip, date, load);
+               }
+            }
 #ifdef	SQLLIB
-         if (db)
-         {                      // Re-run history from database so auto can catch up to current state
-            SQL_RES *res = sql_safe_query_store_free (&sql,
-                                                      sql_printf
-                                                      ("SELECT * FROM `%#S` WHERE `ip`=%#s AND `Updated`>=date_sub(now(),interval 1 day) ORDER BY `Updated`",
-                                                       table, ip));
-            while (sql_fetch_row (res))
+            else if (db && dbup)
             {
-               char *v = sql_col (res, "atemp");
-               if (!v)
-                  continue;
-               atemp = strtod (v, NULL);
-               v = sql_col (res, "stemp");
-               if (!v)
-                  continue;
-               double stemp = strtod (v, NULL);
-               v = sql_col (res, "dt1");
-               if (!v)
-                  continue;
-               double target = strtod (v, NULL);
-               v = sql_col (res, "cmpfreq");
-               if (!v)
-                  continue;
-               double cmpfreq = strtod (v, NULL);
-               int mode = atoi (sql_colz (res, "mode"));
-               char f_rate = *sql_colz (res, "f_rate");
-               atempset = xml_time (sql_colz (res, "updated"));
-               int mompow = atoi (sql_colz (res, "mompow"));
-               int pow = atoi (sql_colz (res, "pow"));
-               doauto (&stemp, &f_rate, &mode, pow, cmpfreq, mompow, atempset, atemp, target);
+               SQL_RES *res = sql_query_store_free (&sql,
+                                                    sql_printf
+                                                    ("SELECT * FROM `%#S` WHERE `ip`=%#s AND `Updated`>=date_sub(now(),interval 1 day) ORDER BY `Updated`",
+                                                     table, ip));
+               if (res)
+               {
+                  while (sql_fetch_row (res))
+                  {
+                     sample_t r;
+                     sqlsample (res, &r);
+                     load (&r);
+                  }
+                  sql_free_result (res);
+               }
             }
-            sql_free_result (res);
-         }
 #endif
+            pthread_mutex_lock (&httpmutex);
+            historyscan (unit->hist, from, warm);
+            pthread_mutex_unlock (&httpmutex);
+         }
+         if (httpport)
+            httpstart (httpbind, httpport, unit);
          time_t next = time (0) / mqttperiod * mqttperiod + mqttperiod;
+         if (powercap)
+            next += peerhash (mqtttopic, strlen (mqtttopic)) % mqttperiod;     // Spread polls, so starts can be staggered
          int e = mosquitto_lib_init ();
          if (e)
             errx (1, "MQTT init failed %s", mosquitto_strerror (e));
          struct mosquitto *mqtt = mosquitto_new (mqttid ? : ip, 1, NULL);
+         if (!mqtt)
+            errx (1, "MQTT init failed");
          e = mosquitto_username_pw_set (mqtt, mqttuser, mqttpass);
          if (e)
             errx (1, "MQTT auth failed %s", mosquitto_strerror (e));
+         char *lwt = NULL;      // Availability, Offline if we die or the unit is not responding
+         if (asprintf (&lwt, "%s/%s/LWT", mqtttele, mqtttopic) < 0)
+            errx (1, "malloc");
+         e = mosquitto_will_set (mqtt, lwt, 7, "Offline", 0, 1);
+         if (e)
+            errx (1, "MQTT will failed %s", mosquitto_strerror (e));
+         int online = -1;       // As last reported
+         void available (void)
+         {                      // Report availability if changed
+            int o = (unit->circuit == CIRCUIT_CLOSED);
+            if (o == online)
+               return;
+            online = o;
+            e = mosquitto_publish (mqtt, NULL, lwt, o ? 6 : 7, o ? "Online" : "Offline", 0, 1);
+            if (mqttdebug)
+               warnx ("Publish %s %s", lwt, o ? "Online" : "Offline");
+         }
+         enum
+         {
+            MQTT_DOWN,          // Not connected, try again at mqttretry
+            MQTT_CONNECTING,    // Waiting for connect to complete
+            MQTT_UP,
+         };
+         int mqttstate = MQTT_DOWN;
+         time_t mqttretry = 0;
+         int mqttbackoff = 0;
+         void mqttdown (const char *why)
+         {                      // Lost or failed, try again later (we carry on working without it)
+            if (mqttstate == MQTT_DOWN)
+               return;
+            mqttstate = MQTT_DOWN;
+            mqttbackoff = (mqttbackoff ? mqttbackoff * 2 : 1);
+            if (mqttbackoff > 60)
+               mqttbackoff = 60;
+            mqttretry = time (0) + mqttbackoff;
+            syslog (LOG_INFO, "%s MQTT %s %s (retry in %ds)", mqtttopic, why, mqtthost, mqttbackoff);
+            if (debug)
+               warnx ("MQTT %s %s (retry in %ds)", why, mqtthost, mqttbackoff);
+         }
          void connect (struct mosquitto *mqtt, void *obj, int rc)
          {
             obj = obj;
-            rc = rc;
-            char *sub = NULL;
-            asprintf (&sub, "%s/%s/#", mqttcmnd, mqtttopic);
+            if (rc)
+            {
+               mqttstate = MQTT_CONNECTING;
+               mqttdown (mosquitto_connack_string (rc));
+               return;
+            }
+            mqttstate = MQTT_UP;
+            mqttbackoff = 0;
+            online = -1;        // Report again
+            available ();
+            if (mqttcbor)
+            {                   // Keys used in CBOR
+               buf_t b = { };
+               cborschema (&b);
+               char *t = NULL;
+               if (asprintf (&t, "%s/%s/SCHEMA", mqtttele, mqtttopic) < 0)
+                  errx (1, "malloc");
+               mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 1);
+               free (t);
+               free (b.data);
+            }
             if (mqttdebug)
-               warnx ("MQTT connect %s for %s", mqtthost, sub);
+               warnx ("MQTT connect %s", mqtthost);
             syslog (LOG_INFO, "%s MQTT connected %s", mqtttopic, mqtthost);
-            int e = mosquitto_subscribe (mqtt, NULL, sub, 0);
-            if (e)
-               errx (1, "MQTT subscribe failed %s", mosquitto_strerror (e));
-            if (debug)
-               warnx ("MQTT subscribed to: [%s]", sub);
-            if (mqttatemp)
+            void subscribe (const char *sub)
             {
-               int e = mosquitto_subscribe (mqtt, NULL, mqttatemp, 0);
+               int e = mosquitto_subscribe (mqtt, NULL, sub, 0);
                if (e)
-                  errx (1, "MQTT subscribe failed %s", mosquitto_strerror (e));
-               if (debug)
-                  warnx ("MQTT subscribed to: [%s]", mqttatemp);
+               {                // Start again
+                  syslog (LOG_INFO, "%s MQTT subscribe %s failed %s", mqtttopic, sub, mosquitto_strerror (e));
+                  mosquitto_disconnect (mqtt);
+                  mqttdown ("subscribe failed");
+               } else if (debug)
+                  warnx ("MQTT subscribed to: [%s]", sub);
             }
-            if (mqttotemp)
+            char *sub = NULL;
+            if (asprintf (&sub, "%s/%s/#", mqttcmnd, mqtttopic) < 0)
+               errx (1, "malloc");
+            subscribe (sub);
+            free (sub);
+            if (powercap || snapshot)
+            {                   // Units may send either or both
+               if (asprintf (&sub, "%s/+/STATE", mqtttele) < 0)
+                  errx (1, "malloc");
+               subscribe (sub);
+               free (sub);
+               if (asprintf (&sub, "%s/+/CBOR", mqtttele) < 0)
+                  errx (1, "malloc");
+               subscribe (sub);
+               free (sub);
+            }
+            if (zones)
             {
-               int e = mosquitto_subscribe (mqtt, NULL, mqttotemp, 0);
-               if (e)
-                  errx (1, "MQTT subscribe failed %s", mosquitto_strerror (e));
+               if (asprintf (&sub, "%s/zone/#", mqttcmnd) < 0)
+                  errx (1, "malloc");
+               subscribe (sub);
+               free (sub);
+            }
+            topicload ();       // Sensors, as settings may have changed
+            topic_t *t;
+            for (t = topicsubs; t; t = t->subnext)
+               subscribe (t->pattern);
+         }
+         void disconnect (struct mosquitto *mqtt, void *obj, int rc)
+         {
+            obj = obj;
+            rc = rc;
+            if (mqttdebug)
+               warnx ("MQTT disconnect %s", mqtthost);
+            mqttdown ("disconnected");
+         }
+         int gen = 0;           // Bumped on each write to the aircon, so a queued control write can tell it is out of date
+         deferlog = 1;
+#ifdef	SQLLIB
+         if (journalpending ())
+            jobadd (JOB_LOG, "replay", NULL);   // Left over from before
+#endif
+         buf_t stat = { };      // STATE JSON, kept for next time
+         buf_t cbor = { };      // STATE CBOR, likewise
+         int statuswanted = 0;  // Status request waiting for a poll
+         void status (void)
+         {                      // Answer status request from latest state
+            buf_t b = { };
+            statuswanted = 0;
+            pthread_mutex_lock (&httpmutex);
+            bufprintf (&b, "{\"age\":%ld", (long) (time (0) - statetime));
+            if (httpstate.len > 2)
+            {
+               bufadd (&b, ",");
+               bufadd (&b, httpstate.data + 1);
+            } else
+               bufadd (&b, "}");
+            pthread_mutex_unlock (&httpmutex);
+            char *t = NULL;
+            if (asprintf (&t, "%s/%s/STATUS", mqttstat, mqtttopic) < 0)
+               errx (1, "malloc");
+            e = mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 0);
+            if (mqttdebug)
+               warnx ("Publish %s %s", t, b.data);
+            free (t);
+            free (b.data);
+         }
+         void energy (void)
+         {                      // Publish energy counters
+            buf_t b = { };
+            energyjson (&b, unit->energy);
+            char *t = NULL;
+            if (asprintf (&t, "%s/%s/ENERGY", mqtttele, mqtttopic) < 0)
+               errx (1, "malloc");
+            e = mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 0);
+            if (mqttdebug)
+               warnx ("Publish %s %s", t, b.data);
+            free (t);
+            free (b.data);
+         }
+         void pollstate (time_t now)
+         {                      // Process status just read - automatic control, logging and reporting
+            double v;
+            if (atempset && sensorfuse (SENSOR_atemp, now, &v))
+               atemp = v;       // Without any sources that have gone quiet
+            if (atempset && atempset < now - mqttmaxdelay)
+            {
+               atempset = 0;
                if (debug)
-                  warnx ("MQTT subscribed to: [%s]", mqttotemp);
+                  warnx ("No temp set, stopping control");
             }
-            if (mqttco2)
+            if (co2set && co2set < now - mqttmaxdelay)
             {
-               int e = mosquitto_subscribe (mqtt, NULL, mqttco2, 0);
-               if (e)
-                  errx (1, "MQTT subscribe failed %s", mosquitto_strerror (e));
+               co2set = 0;
                if (debug)
-                  warnx ("MQTT subscribed to: [%s]", mqttco2);
+                  warnx ("No CO2 set");
             }
-            if (mqttrh)
+            if (rhset && rhset < now - mqttmaxdelay)
             {
-               int e = mosquitto_subscribe (mqtt, NULL, mqttrh, 0);
-               if (e)
-                  errx (1, "MQTT subscribe failed %s", mosquitto_strerror (e));
+               rhset = 0;
                if (debug)
-                  warnx ("MQTT subscribed to: [%s]", mqttrh);
+                  warnx ("No CO2 set");
             }
-            free (sub);
+            if (atempset)
+            {                   // Automatic processing
+               double newstemp = thisstemp;
+               char newf_rate = thisf_rate;
+               int newmode = thismode;
+               double target = thisdt[1];
+               int ease = 0,
+                  hold = 0;
+               if (powercap)
+                  powerplan (now, thismompow * 100, thiscmpfreq, &ease, &hold);
+               if (ease)
+                  target += (thismode == 3 ? powerbias : -powerbias);   // Ease off
+               docontrol (unit->control, &newstemp, &newf_rate, &newmode, thispow, thiscmpfreq, thismompow, now, atemp,
+                          mqttotemp ? (otempset ? otemp : NAN) : thisotemp, target);
+               if (powercap && thispow && !thiscmpfreq && newstemp && (newmode == 3 || newmode == 4))
+               {                // Would start compressor
+                  if (hold)
+                     newstemp = 0;      // Not yet
+                  else
+                     powerstarted = now;
+               }
+               if (newstemp)
+               {                // Rounding temp to step the unit accepts, with error dither
+                  double rtemp = newstemp;
+                  newstemp = quantise (&unit->quant, newstemp, now, mqttperiod);
+                  if (debug)
+                     warnx ("Set %.2lf as %.1lf dither error was %+.2lf", rtemp, newstemp, unit->quant.dither);
+               } else if (newmode == 3 || newmode == 4)
+               {                // Compressor stop
+                  newstemp = (newmode == 4 ? mintemp : maxtemp);
+                  next = now + 10;      // Re check that it stopped
+                  if (debug)
+                     warnx ("Compressor stop at %.1lf", atemp);
+                  // TODO if htemp too close to limits this does not work and so may want to force fan mode? Maybe we try this and then fan mode?
+               }
+               if (newstemp > maxtemp)
+                  newstemp = maxtemp;
+               else if (newstemp < mintemp)
+                  newstemp = mintemp;
+               // Apply changes
+               if (newstemp != thisstemp)
+               {
+                  if (stemp)
+                     free (stemp);
+                  if (asprintf (&stemp, "%.1lf", newstemp) < 0)
+                     errx (1, "malloc");
+                  changed = 1;
+               }
+               if (newf_rate != thisf_rate)
+               {
+                  if (f_rate)
+                     free (f_rate);
+                  if (asprintf (&f_rate, "%c", newf_rate) < 0)
+                     errx (1, "malloc");
+                  changed = 1;
+               }
+               if (newmode != thismode)
+               {
+                  if (mode)
+                     free (mode);
+                  if (asprintf (&mode, "%d", newmode) < 0)
+                     errx (1, "malloc");
+                  changed = 1;
+               }
+            }
+
+            if (changed)
+            {                   // Queued, so any user command that arrives first wins
+               job_t *j = jobadd (JOB_CONTROL, NULL, NULL);
+               j->url = settingsurl ();
+               j->gen = gen;
+            }
+            if (energyadd (unit->energy, now, thispow, thismode, thismompow, thiscmpfreq))
+               energy ();       // Hourly
+            if (statedir)
+               energysave (statedir, ip, unit->energy);
+            updatedb ();
+            bufreset (&stat);
+            bufreset (&cbor);
+            bufneed (&cbor, 1);
+            cbor.data[cbor.len++] = 0xBF;       // Map, indefinite length
+            cborint (&cbor, CBOR_SCHEMA);
+            cborint (&cbor, CBORSCHEMA);
+            void check (char *tag, char *val)
+            {
+               int f = fieldfind (tag);
+               if (f < 0 || !(fieldtable[f].flags & FIELD_STATE))
+                  return;       // Only some things we report
+               if (f < CONTROLS && *settings[f])
+                  val = *settings[f];   // Use the setting we now have
+               bufadd (&stat, stat.len ? "," : "{");
+               bufjson (&stat, tag);
+               bufadd (&stat, ":");
+               bufjson (&stat, val);
+               cborint (&cbor, f);
+               cborfield (&cbor, f, val);
+            }
+            scan (sensor, check);
+            scan (control, check);
+            if (atempset)
+            {
+               bufprintf (&stat, "%s\"atemp\":\"%.1lf\"", stat.len ? "," : "{", atemp);
+               cborint (&cbor, FIELD_atemp);
+               cborfloat (&cbor, round (atemp * 10) / 10);
+            }
+            if (powercap)
+            {
+               bufprintf (&stat, "%s\"priority\":%d,\"started\":%ld", stat.len ? "," : "{", powerpriority, (long) powerstarted);
+               cborint (&cbor, CBOR_PRIORITY);
+               cborint (&cbor, powerpriority);
+               cborint (&cbor, CBOR_STARTED);
+               cborint (&cbor, powerstarted);
+            }
+            bufadd (&stat, stat.len ? "}" : "{}");
+            bufneed (&cbor, 1);
+            cbor.data[cbor.len++] = 0xFF;       // End of map
+            char *topic = NULL;
+            if (mqttjson)
+            {
+               asprintf (&topic, "%s/%s/STATE", mqtttele, mqtttopic);
+               e = mosquitto_publish (mqtt, NULL, topic, stat.len, stat.data, 0, 1);
+               if (mqttdebug)
+                  warnx ("Publish %s %s", topic, stat.data);
+               free (topic);
+            }
+            if (mqttcbor)
+            {
+               asprintf (&topic, "%s/%s/CBOR", mqtttele, mqtttopic);
+               e = mosquitto_publish (mqtt, NULL, topic, cbor.len, cbor.data, 0, 1);
+               if (mqttdebug)
+                  warnx ("Publish %s (%d bytes, JSON %d)", topic, (int) cbor.len, (int) stat.len);
+               free (topic);
+            }
+            statecache (&stat);
+            if (statuswanted)
+               status ();
          }
-         void disconnect (struct mosquitto *mqtt, void *obj, int rc)
-         {
-            obj = obj;
-            rc = rc;
+         void command (const char *topic, const char *val)
+         {                      // User command
+            if (getstatus ())
+            {
+               updatestatus ();
+               if (!strcmp (topic, "mode") && val && isdigit (*val))
+               {                // New temp for mode
+                  if (stemp)
+                     free (stemp);
+                  asprintf (&stemp, "%.1lf", thisdt[*val - '0']);
+               }
+               int f = fieldfind (topic);
+               if (f >= 0 && f < CONTROLS && val && (!*settings[f] || strcmp (*settings[f], val)))
+               {                // Setting
+                  if (*settings[f])
+                     free (*settings[f]);
+                  *settings[f] = strdup (val);
+                  changed = 1;
+               }
+               if (f >= FIELD_dt1 && f <= FIELD_dt7)
+               {                // Special case, setting dtN means setting a mode and stemp
+                  char *url = NULL;
+                  size_t len = 0;
+                  FILE *o = open_memstream (&url, &len);
+                  fprintf (o, "http://%s/aircon/set_control_info?", ip);
+                  int c;
+                  for (c = 0; c < CONTROLS; c++)
+                     if (c == FIELD_stemp)
+                        fprintf (o, "%s=%s&", fieldtable[c].name, val);
+                     else if (c == FIELD_mode)
+                        fprintf (o, "%s=%s&", fieldtable[c].name, topic + 2);
+                     else
+                        fprintf (o, "%s=%s&", fieldtable[c].name, *settings[c]);
+                  fclose (o);
+                  url[--len] = 0;
+                  char *ok = set (url);
+                  if (ok)
+                     free (ok);
+                  gen++;
+                  thisdt[topic[2] - '0'] = strtod (val, NULL);
+                  if (mode && atoi (mode) && atoi (mode) != atoi (topic + 2))
+                     changed = 1;       // Force setting back to right mode
+               }
+               if (changed)
+               {
+                  updatesettings ();
+                  gen++;
+               }
+               time_t now = time (0);
+               if (jobfind (JOB_POLL, NULL) || next - now <= pollmerge)
+               {                // Poll queued or nearly due, so use what we have just read instead of reading again
+                  if (!jobfind (JOB_POLL, NULL))
+                     next += mqttperiod;
+                  jobdrop (JOB_POLL);
+                  if (debug)
+                     warnx ("Poll merged in to command");
+                  // What we just read, as changed by the command
+                  if (pow)
+                     thispow = atoi (pow);
+                  if (mode && (thismode = atoi (mode)) >= sizeof (modename) / sizeof (*modename))
+                     thismode = 0;
+                  if (stemp)
+                     thisstemp = strtod (stemp, NULL);
+                  if (f_rate)
+                     thisf_rate = *f_rate;
+                  changed = 0;
+                  pollstate (now);
+               }
+            }
+            freestatus ();
+         }
+         void zone (const char *topic, const char *val)
+         {                      // Zone command, topic is [name]/[field]
+            const char *f = strchr (topic, '/');
+            zone_t *z;
+            if (!f || strchr (f + 1, '/') || !(z = zonefind (topic, f - topic)))
+               return;          // Not one of ours
+            buf_t b = { };
+            zonecommand (&b, z, f + 1, val, retries);
+            char *t = NULL;
+            if (asprintf (&t, "%s/zone/%s/RESULT", mqttstat, z->name) < 0)
+               errx (1, "malloc");
+            e = mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 0);
             if (mqttdebug)
-               warnx ("MQTT disconnect %s", mqtthost);
-            syslog (LOG_INFO, "%s MQTT disconnected %s (reconnecting)", mqtttopic, mqtthost);
-            e = mosquitto_reconnect (mqtt);
-            if (e)
-               errx (1, "MQTT reconnect failed (%s) %s", mqtthost, mosquitto_strerror (e));
+               warnx ("Publish %s %s", t, b.data);
+            free (t);
+            free (b.data);
+            int i;
+            for (i = 0; i < z->count && strcmp (z->ips[i], ip); i++);
+            if (i < z->count)
+            {                   // Includes our unit
+               gen++;
+               jobadd (JOB_POLL, NULL, NULL);
+            }
+         }
+         void runjob (job_t * j)
+         {
+            time_t now = time (0);
+            switch (j->pri)
+            {
+            case JOB_CMND:
+               if (!strncmp (j->tag, "zone/", 5))
+                  zone (j->tag + 5, j->val);
+               else if (now < unit->written + writegap)
+               {                // Too soon after last write, try again after the gap
+                  if (!jobfind (JOB_CMND, j->tag))      // Else a newer value is already queued
+                     jobadd (JOB_CMND, j->tag, j->val)->after = unit->written + writegap;
+                  break;
+               } else
+                  command (j->tag, j->val);
+               if (debug)
+               {
+                  struct timeval tv;
+                  gettimeofday (&tv, NULL);
+                  warnx ("Command %s=%s done in %ldms", j->tag, j->val,
+                         (tv.tv_sec - j->queued.tv_sec) * 1000 + (tv.tv_usec - j->queued.tv_usec) / 1000);
+               }
+               break;
+            case JOB_CONTROL:
+               if (j->gen != gen)
+               {                // Something else written since this was worked out
+                  if (debug)
+                     warnx ("Control write dropped, settings changed since");
+                  break;
+               }
+               if (time (0) < unit->written + writegap)
+               {                // Will be worked out again on next poll
+                  if (debug)
+                     warnx ("Control write dropped, too soon after last write");
+                  break;
+               }
+               unitlock (locked = unit);        // So get uses the unit's timeout, circuit breaker and stats
+               char *ok = set (j->url);
+               j->url = NULL;   // Freed by set
+               unitunlock (locked);
+               locked = NULL;
+               if (ok)
+                  free (ok);
+               gen++;
+               break;
+            case JOB_POLL:
+               if (getstatus ())
+               {
+                  updatestatus ();
+                  pollstate (now);
+               } else
+               {
+                  next = unitretry (unit, now); // Try again, when worth trying
+                  if (statuswanted && httpstate.len)
+                     status (); // Best we have
+               }
+               freestatus ();
+               break;
+            case JOB_LOG:
+#ifdef SQLLIB
+               if (j->val)
+                  dblog (j->val);
+               else if (journalreplay ())
+                  jobadd (JOB_LOG, "replay", NULL);     // Carry on after anything more important
+#endif
+               break;
+            }
          }
          void message (struct mosquitto *mqtt, void *obj, const struct mosquitto_message *msg)
          {
             obj = obj;
             char *topic = msg->topic;
+            if (powercap || snapshot)
+            {
+               int l = strlen (mqtttele),
+                  t = strlen (topic);
+               if (!strncmp (topic, mqtttele, l) && topic[l] == '/' && t > l + 7 && !strcmp (topic + t - 6, "/STATE"))
+               {                // Peer state for power cap or snapshot, not logged as there are lots
+                  peerstate (topic + l + 1, t - l - 7, msg->payload, msg->payloadlen);
+                  return;
+               }
+               if (!strncmp (topic, mqtttele, l) && topic[l] == '/' && t > l + 6 && !strcmp (topic + t - 5, "/CBOR"))
+               {                // Likewise, as JSON
+                  static buf_t j = { };
+                  if (!msg->payloadlen)
+                     peerstate (topic + l + 1, t - l - 6, "", 0);
+                  else if (cborstate (&j, msg->payload, msg->payloadlen))
+                     peerstate (topic + l + 1, t - l - 6, j.data, j.len);
+                  return;
+               }
+            }
             if (mqttdebug)
                warnx ("MQTT message %s %.*s", topic, msg->payloadlen, (char *) msg->payload);
             syslog (LOG_INFO, "%s MQTT message %s %.*s", mqtttopic, topic, msg->payloadlen, (char *) msg->payload);
@@ -1238,242 +5896,262 @@ main (int argc, const char *argv[])
             char *val = malloc (l + 1);
             memcpy (val, p, l);
             val[l] = 0;
-            if (mqttatemp && !strcmp (topic, mqttatemp))
-            {                   // Direct atemp topic set
-               double v = strtod (val, NULL);
-               if (v)
-               {
+            int sensed = 0;
+            void sensorset (route_t * r)
+            {                   // Sensor topic set
+               sensed = 1;
+               char *s = NULL;
+               if (r->select && !(s = jsonselect (msg->payload, msg->payloadlen, r->select)))
+                  return;       // Not in this message
+               char *e;
+               double v = strtod (s ? : val, &e);
+               int ok = (e > (s ? : val));
+               free (s);
+               if (!ok)
+                  return;
+               time_t now = time (0);
+               char *name = NULL;
+               if (asprintf (&name, "%s%s%s", topic, r->select ? " " : "", r->select ? : "") < 0)
+                  errx (1, "malloc");
+               int n = sensorreading (r->sensor, name, r->weight, v, now, &v);
+               free (name);
+               switch (r->sensor)
+               {                // Only poll early (to act on it) if new or moved, else it waits for the next poll
+               case SENSOR_atemp:
+                  if (!atempset || fabs (v - atemp) > sensorspread[SENSOR_atemp])
+                     next = now;
                   atemp = v;
-                  next = atempset = time (0);
-                  if (debug)
-                     warnx ("atemp=%.1lf (MQTT)", atemp);
-               }
-            } else if (mqttotemp && !strcmp (topic, mqttotemp))
-            {                   // Direct otemp topic set
-               double v = strtod (val, NULL);
-               if (v)
-               {
+                  atempset = now;
+                  break;
+               case SENSOR_otemp:
+                  if (!otempset || fabs (v - otemp) > sensorspread[SENSOR_otemp])
+                     next = now;
                   otemp = v;
-                  next = otempset = time (0);
-                  if (debug)
-                     warnx ("otemp=%.1lf (MQTT)", otemp);
-               }
-            } else if (mqttco2 && !strcmp (topic, mqttco2))
-            {                   // Direct co2 topic set
-               double v = strtod (val, NULL);
-               if (v)
-               {
+                  otempset = now;
+                  break;
+               case SENSOR_co2:
                   co2 = v;
-                  co2set = time (0);
-                  if (debug)
-                     warnx ("co2=%.1lf (MQTT)", co2);
-               }
-            } else if (mqttrh && !strcmp (topic, mqttrh))
-            {                   // Direct rh topic set
-               double v = strtod (val, NULL);
-               if (v)
-               {
+                  co2set = now;
+                  break;
+               case SENSOR_rh:
                   rh = v;
-                  rhset = time (0);
-                  if (debug)
-                     warnx ("rh=%.1lf (MQTT)", rh);
+                  rhset = now;
+                  break;
                }
-            } else
+               if (debug)
+                  warnx ("%s=%.1lf (MQTT, %d source%s)", sensorname[r->sensor], v, n, n == 1 ? "" : "s");
+            }
+            topicmatch (topic, sensorset);
+            if (!sensed)
             {
                l = strlen (mqttcmnd);
                if (strncmp (topic, mqttcmnd, l) || topic[l] != '/')
+               {
+                  free (val);
                   return;
+               }
                topic += l + 1;
+               void result (const char *target, const char *tag, const char *error)
+               {                // Report rejected or changed command
+                  buf_t b = { };
+                  bufadd (&b, "{\"field\":");
+                  bufjson (&b, tag);
+                  bufadd (&b, ",\"value\":");
+                  bufjson (&b, val);
+                  bufadd (&b, ",\"error\":");
+                  bufjson (&b, error);
+                  bufadd (&b, "}");
+                  char *t = NULL;
+                  if (asprintf (&t, "%s/%s/RESULT", mqttstat, target) < 0)
+                     errx (1, "malloc");
+                  e = mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 0);
+                  if (mqttdebug)
+                     warnx ("Publish %s %s", t, b.data);
+                  syslog (LOG_INFO, "%s %s=%s %s", target, tag, val, error);
+                  free (t);
+                  free (b.data);
+               }
+               if (zones && !strncmp (topic, "zone/", 5))
+               {                // Zone command, queued with the zone in the tag
+                  char *tag = strrchr (topic, '/') + 1;
+                  const char *error;
+                  int ok = cmndcheck (tag, &val, -1, &error);
+                  if (error)
+                  {
+                     char *target = strndup (topic, tag - 1 - topic);
+                     result (target, tag, error);
+                     free (target);
+                  }
+                  if (ok)
+                     jobadd (JOB_CMND, topic, val);
+                  free (val);
+                  return;
+               }
                l = strlen (mqtttopic);
                if (strncmp (topic, mqtttopic, l) || topic[l] != '/')
+               {
+                  free (val);
                   return;
+               }
                topic += l + 1;
-               if (getstatus ())
-               {
-                  updatestatus ();
-                  if (!strcmp (topic, "mode") && val && isdigit (*val))
-                  {             // New temp for mode
-                     if (stemp)
-                        free (stemp);
-                     asprintf (&stemp, "%.1lf", thisdt[*val - '0']);
-                  }
-#define	c(x,t,v) if(!strcmp(#x,topic)){if(val&&(!x||strcmp(x,val))){if(x)free(x);x=strdup(val);changed=1;}}
-                  controlfields;
-#undef c
-                  if (!mqttatemp && !strcmp (topic, "atemp"))
+               if (!mqttatemp && !strcmp (topic, "atemp"))
+               {                // Not a setting, so no need to talk to the aircon
+                  char *e;
+                  double v = strtod (val, &e);
+                  if (e > val && sensorreading (SENSOR_atemp, "cmnd", 1, v, time (0), &v))
                   {
-                     double v = strtod (val, NULL);
-                     if (v)
-                     {
-                        atemp = v;
-                        next = atempset = time (0);
-                        if (debug)
-                           warnx ("atemp=%.1lf (MQTT)", atemp);
-                     }
+                     if (!atempset || fabs (v - atemp) > sensorspread[SENSOR_atemp])
+                        next = time (0);        // As above
+                     atemp = v;
+                     atempset = time (0);
+                     if (debug)
+                        warnx ("atemp=%.1lf (MQTT)", atemp);
                   }
-                  if (topic[0] == 'd' && topic[1] == 't' && isdigit (topic[2]) && !topic[3])
-                  {             // Special case, setting dtN means setting a mode and stemp
-                     char *url = NULL;
-                     size_t len = 0;
-                     FILE *o = open_memstream (&url, &len);
-                     fprintf (o, "http://%s/aircon/set_control_info?", ip);
-#define c(x,t,v) if(!strcmp(#x,"stemp"))fprintf(o,"%s=%s&",#x,val); else if(!strcmp(#x,"mode"))fprintf(o,"%s=%s&",#x,topic+2); else fprintf(o,"%s=%s&",#x,x);
-                     controlfields
-#undef c
-                        fclose (o);
-                     url[--len] = 0;
-                     char *ok = get (url);
-                     if (ok)
-                        free (ok);
-                     if (mode && atoi (mode) && atoi (mode) != atoi (topic + 2))
-                        changed = 1;    // Force setting back to right mode
+               } else if (!strcmp (topic, "status"))
+               {                // Status from last poll, unless too old
+                  pthread_mutex_lock (&httpmutex);
+                  int fresh = (httpstate.len && time (0) - statetime <= statusmaxage);
+                  pthread_mutex_unlock (&httpmutex);
+                  if (fresh)
+                     status ();
+                  else
+                  {             // Answered after poll
+                     statuswanted = 1;
+                     jobadd (JOB_POLL, NULL, NULL);
                   }
-                  if (changed)
-                     updatesettings (sensor, control);
+               } else if (!strcmp (topic, "energy"))
+                  energy ();
+               else if (!strcmp (topic, "history"))
+               {                // Dump recent history, optionally only last N minutes
+                  buf_t b = { };
+                  pthread_mutex_lock (&httpmutex);
+                  historyjson (&b, unit->hist, ip, *val ? time (0) - atoi (val) * 60 : 0);
+                  pthread_mutex_unlock (&httpmutex);
+                  char *t = NULL;
+                  if (asprintf (&t, "%s/%s/HISTORY", mqtttele, mqtttopic) < 0)
+                     errx (1, "malloc");
+                  e = mosquitto_publish (mqtt, NULL, t, b.len, b.data, 0, 0);
+                  if (mqttdebug)
+                     warnx ("Publish %s (%lu bytes)", t, (unsigned long) b.len);
+                  free (t);
+                  free (b.data);
+               } else
+               {                // Checked here, so a bad command costs no traffic to the aircon
+                  const char *error;
+                  int ok = cmndcheck (topic, &val, thismode, &error);
+                  if (error)
+                     result (mqtttopic, topic, error);
+                  if (ok)
+                     jobadd (JOB_CMND, topic, val);     // Done from main loop in priority order
                }
-               freestatus ();
             }
             free (val);
          }
          mosquitto_connect_callback_set (mqtt, connect);
          mosquitto_disconnect_callback_set (mqtt, disconnect);
          mosquitto_message_callback_set (mqtt, message);
-	 mosquitto_reconnect_delay_set (mqtt, 5, 300, true);
-         e = mosquitto_connect (mqtt, mqtthost, 1883, 60);
-         if (e)
-            errx (1, "MQTT connect failed (%s) %s", mqtthost, mosquitto_strerror (e));
          if (debug)
          {
             debug++;
             warnx ("Starting service");
          }
+#ifdef	LIBSYSTEMD
+         uint64_t watchdog = 0; // Watchdog interval (us), pinged as we go round the loop, so only a real hang misses it
+         if (sd_watchdog_enabled (0, &watchdog) <= 0)
+            watchdog = 0;
+         uint64_t pinged = 0;   // Monotonic us
+         uint64_t monotonic (void)
+         {
+            struct timespec ts;
+            clock_gettime (CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+         }
+         sd_notify (0, "READY=1");
+#endif
          while (1)
          {
             time_t now = time (0);
-            int to = next - now;
-            if (to <= 0)
-            {                   // stat
-               next += mqttperiod;
-               if (getstatus ())
+#ifdef	LIBSYSTEMD
+            if (watchdog && monotonic () >= pinged + watchdog / 2)
+            {
+               sd_notifyf (0, "WATCHDOG=1\nSTATUS=MQTT %s, A/C %s", mqttstate == MQTT_UP ? "connected" : "not connected",
+                           unit->circuit == CIRCUIT_CLOSED ? "responding" : "not responding");
+               pinged = monotonic ();
+            }
+#endif
+            if (configreload)
+            {                   // Safe point, between jobs
+               configreload = 0;
+               config_t *c = configread (configfile, ip);
+               if (!c)
+                  syslog (LOG_INFO, "%s Config %s not valid, not changed", mqtttopic, configfile);
+               else
                {
-                  updatestatus ();
-                  if (atempset && atempset < now - mqttmaxdelay)
-                  {
-                     atempset = 0;
-                     if (debug)
-                        warnx ("No temp set, stopping control");
-                  }
-                  if (co2set && co2set < now - mqttmaxdelay)
-                  {
-                     co2set = 0;
-                     if (debug)
-                        warnx ("No CO2 set");
-                  }
-                  if (rhset && rhset < now - mqttmaxdelay)
-                  {
-                     rhset = 0;
-                     if (debug)
-                        warnx ("No CO2 set");
-                  }
-                  if (atempset)
-                  {             // Automatic processing
-                     double newstemp = thisstemp;
-                     char newf_rate = thisf_rate;
-                     int newmode = thismode;
-                     doauto (&newstemp, &newf_rate, &newmode, thispow, thiscmpfreq, thismompow, now, atemp, thisdt[1]);
-                     if (newstemp)
-                     {          // Rounding temp to 0.5C with error dither
-                        static double dither = 0;
-                        static double lasterr = 0;
-                        static time_t lastset = 0;
-                        double rtemp = newstemp;
-                        if (!lastset)
-                           lastset = now;
-                        dither += lasterr * (now - lastset) / mqttperiod;
-                        newstemp = round ((newstemp - dither) * 2) / 2; // It gets upset if not .0 or .5
-                        lasterr = newstemp - rtemp;
-                        lastset = now;
-                        if (debug)
-                           warnx ("Set %.2lf as %.1lf dither error was %+.2lf", rtemp, newstemp, dither);
-                     } else if (newmode == 3 || newmode == 4)
-                     {          // Compressor stop
-                        newstemp = (newmode == 4 ? mintemp : maxtemp);
-                        next = now + 10;        // Re check that it stopped
-                        if (debug)
-                           warnx ("Compressor stop at %.1lf", atemp);
-                        // TODO if htemp too close to limits this does not work and so may want to force fan mode? Maybe we try this and then fan mode?
-                     }
-                     if (newstemp > maxtemp)
-                        newstemp = maxtemp;
-                     else if (newstemp < mintemp)
-                        newstemp = mintemp;
-                     // Apply changes
-                     if (newstemp != thisstemp)
-                     {
-                        if (stemp)
-                           free (stemp);
-                        if (asprintf (&stemp, "%.1lf", newstemp) < 0)
-                           errx (1, "malloc");
-                        changed = 1;
-                     }
-                     if (newf_rate != thisf_rate)
-                     {
-                        if (f_rate)
-                           free (f_rate);
-                        if (asprintf (&f_rate, "%c", newf_rate) < 0)
-                           errx (1, "malloc");
-                        changed = 1;
-                     }
-                     if (newmode != thismode)
-                     {
-                        if (mode)
-                           free (mode);
-                        if (asprintf (&mode, "%d", newmode) < 0)
-                           errx (1, "malloc");
-                        changed = 1;
-                     }
-                  }
-
-                  if (changed)
-                     updatesettings (sensor, control);
-                  updatedb ();
-                  xml_t stat = xml_tree_new (NULL);
-                  void check (char *tag, char *val)
-                  {
-                     // Only some things we report
-                     if (!strncmp (tag, "b_", 2)
-                         || (strncmp (tag, "f_", 2) && !strstr (tag, "pow") && !strstr (tag, "temp") && strcmp (tag, "mode")
-                             && !strstr (tag, "hum") && strcmp (tag, "adv")))
-                        return;
-                     xml_attribute_set (stat, tag, val);
+                  syslog (LOG_INFO, "%s Config %s loaded", mqtttopic, configfile);
+                  if (configapply (c, unit) && mqttstate != MQTT_DOWN)
+                  {             // Topics changed
+                     mosquitto_disconnect (mqtt);
+                     mqttdown ("resubscribing");
                   }
-                  scan (sensor, check);
-                  scan (control, check);
-                  if (atempset)
-                     xml_addf (stat, "@atemp", "%.1lf", atemp);
-                  char *statbuf = NULL;
-                  size_t statlen = 0;
-                  FILE *s = open_memstream (&statbuf, &statlen);
-                  xml_write_json (s, stat);
-                  fclose (s);
-                  char *topic = NULL;
-                  asprintf (&topic, "%s/%s/STATE", mqtttele, mqtttopic);
-                  e = mosquitto_publish (mqtt, NULL, topic, strlen (statbuf), statbuf, 0, 1);
+               }
+            }
+            if (mqttstate == MQTT_DOWN && now >= mqttretry)
+            {                   // (Re)connect
+               mqttstate = MQTT_CONNECTING;
+               e = mosquitto_connect (mqtt, mqtthost, 1883, 60);
+               if (e)
+                  mqttdown (mosquitto_strerror (e));
+            }
+            if (now >= next)
+            {                   // Poll due
+               next += mqttperiod;
+               jobadd (JOB_POLL, NULL, NULL);
+               if (snapshotchanged && mqttstate == MQTT_UP)
+               {                // Estate snapshot, as is
+                  char *t = NULL;
+                  if (asprintf (&t, "%s/estate/SNAPSHOT", mqtttele) < 0)
+                     errx (1, "malloc");
+                  e = mosquitto_publish (mqtt, NULL, t, snapshotbuf.len, snapshotbuf.data, 0, 1);
                   if (mqttdebug)
-                     warnx ("Publish %s %s", topic, statbuf);
-                  free (topic);
-                  free (statbuf);
-                  xml_tree_delete (stat);
-               } else
-                  next = now;   // Try again!
-               freestatus ();
-               to = next - now;
+                     warnx ("Publish %s (%d bytes)", t, (int) snapshotbuf.len);
+                  free (t);
+                  snapshotchanged = 0;
+               }
+            }
+            int to = 0;         // Wait (ms), none so we pick up any new commands before next job
+            job_t *j = jobnext ();
+            if (j)
+            {
+               runjob (j);
+               jobfree (j);
+               available ();
+            } else
+            {
+               time_t wait = next - now;
+               time_t after = jobafter ();
+               if (after && wait > after - now)
+                  wait = after - now;
+               if (mqttstate == MQTT_DOWN && wait > mqttretry - now)
+                  wait = mqttretry - now;
+               to = (wait < 1 ? 1 : wait) * 1000;
+#ifdef	LIBSYSTEMD
+               if (watchdog)
+               {                // Not beyond when next ping is due
+                  uint64_t due = pinged + watchdog / 2,
+                     t = monotonic ();
+                  int left = (due > t ? (due - t) / 1000 : 0);
+                  if (to > left)
+                     to = left;
+               }
+#endif
+            }
+            if (mqttstate == MQTT_DOWN)
+               usleep (to * 1000);      // Carry on polling and logging without MQTT
+            else if ((e = mosquitto_loop (mqtt, to, 1)))
+            {
+               mosquitto_disconnect (mqtt);
+               mqttdown (mosquitto_strerror (e));
             }
-            if (to < 1)
-               to = 1;
-            e = mosquitto_loop (mqtt, to * 1000, 1);
-            if (e)
-               errx (1, "MQTT loop failed %s (to %d)", mosquitto_strerror (e), to * 1000);
          }
          mosquitto_destroy (mqtt);
          mosquitto_lib_cleanup ();
@@ -1486,7 +6164,7 @@ main (int argc, const char *argv[])
             if (setmode && isdigit (*setmode) && !setstemp)
                asprintf (&setstemp, "%.1lf", thisdt[*setmode - '0']);   // Pick up temp from new mode
             updatestatus (sensor, control);
-#define	c(x,t,v) if(set##x&&x&&strcmp(x,set##x)){changed=1;if(x)free(x);x=strdup(set##x);}
+#define	c(x,...) if(set##x&&x&&strcmp(x,set##x)){changed=1;if(x)free(x);x=strdup(set##x);}
             controlfields;
 #undef c
             if (changed)
@@ -1501,7 +6179,8 @@ main (int argc, const char *argv[])
       {
          if (fields)
             sql_free_result (fields);
-         sql_close (&sql);
+         if (dbup)
+            sql_close (&sql);
       }
 #endif
 #ifdef	LIBSNMP